@@ -114,6 +114,7 @@ struct tlbshootdown {
 	 */
 	struct addrspace *ts_addrspace;
 	vaddr_t ts_vaddr;
+	struct semaphore *ts_done;	/* if not NULL, V'd once done */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -34,6 +34,7 @@
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <addrspace.h>
 #include <syscall.h>
 
 
@@ -120,6 +121,9 @@ syscall(struct trapframe *tf)
 	  /* sys__exit does not return, execution should not get here */
 	  panic("unexpected return from sys__exit");
 	  break;
+	case SYS_fork:
+	  err = sys_fork(tf, (pid_t *)&retval);
+	  break;
 	case SYS_getpid:
 	  err = sys_getpid((pid_t *)&retval);
 	  break;
@@ -129,6 +133,11 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	case SYS_spawn:
+	  err = sys_spawn((userptr_t)tf->tf_a0,
+			  (userptr_t)tf->tf_a1,
+			  (pid_t *)&retval);
+	  break;
 #endif // UW
 
 	    /* Add stuff here */
@@ -171,13 +180,25 @@ syscall(struct trapframe *tf)
 /*
  * Enter user mode for a newly forked process.
  *
- * This function is provided as a reminder. You need to write
- * both it and the code that calls it.
- *
- * Thus, you can trash it and do things another way if you prefer.
+ * TF is a kmalloc'd copy of the parent's trapframe at the time of the
+ * fork() call, made by sys_fork; we take ownership of it. The child's
+ * address space has already been installed in curproc.
  */
 void
 enter_forked_process(struct trapframe *tf)
 {
-	(void)tf;
+	struct trapframe childtf;
+
+	/* mips_usermode wants the trapframe on this thread's own stack. */
+	childtf = *tf;
+	kfree(tf);
+
+	childtf.tf_v0 = 0;		/* fork returns 0 in the child */
+	childtf.tf_a3 = 0;		/* signal no error */
+	childtf.tf_epc += 4;		/* skip the syscall instruction */
+
+	as_activate();
+
+	mips_usermode(&childtf);
+	panic("mips_usermode returned\n");
 }
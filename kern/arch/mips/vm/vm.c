@@ -0,0 +1,366 @@
+/*
+ * MIPS side of the paged VM system: bootstrap, the TLB miss handler,
+ * and the parts of the address space interface that touch the TLB.
+ *
+ * vm_fault() looks the faulting page up in the current address
+ * space's page table, gives it a fresh frame if it has never been
+ * touched (filled from the executable or left zeroed, see
+ * as_loadpage), and loads the translation into the TLB. When
+ * every TLB slot is in use, slots are recycled round-robin.
+ *
+ * Pages shared copy-on-write after a fork are entered into the TLB
+ * without write permission. The first write then arrives here as
+ * VM_FAULT_READONLY (or as VM_FAULT_WRITE if the page wasn't in the
+ * TLB at all) and the writer gets a private copy of the frame.
+ *
+ * Pages that have been evicted are read back from swap. The frame is
+ * kept pinned from the moment the page table entry is looked at until
+ * the translation is in the TLB, so that the page can't be evicted
+ * in between and leave a stale translation behind.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <proc.h>
+#include <current.h>
+#include <synch.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+#include <vm.h>
+
+/* Next TLB slot to evict on each CPU once its TLB is full */
+static unsigned tlb_nextvictim[MAXCPUS];
+
+/* One cross-CPU shootdown at a time; the others V tlb_donesem. */
+static struct lock *tlb_shootdownlock;
+static struct semaphore *tlb_donesem;
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	vmstats_init();
+
+	tlb_shootdownlock = lock_create("tlbshootdown");
+	tlb_donesem = sem_create("tlbshootdown", 0);
+	if (tlb_shootdownlock == NULL || tlb_donesem == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+
+	if (swap_bootstrap()) {
+		coremap_startdaemon();
+	}
+}
+
+/*
+ * Load a translation into this CPU's TLB. An existing entry for the
+ * page is updated in place. Otherwise uses an invalid slot if there
+ * is one, and failing that replaces slots in round-robin order, which
+ * approximates FIFO without needing any per-entry bookkeeping.
+ */
+static
+void
+tlb_insert(uint32_t ehi, uint32_t elo)
+{
+	uint32_t oehi, oelo;
+	unsigned victim;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return;
+	}
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&oehi, &oelo, i);
+		if (oelo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		splx(spl);
+		return;
+	}
+
+	victim = tlb_nextvictim[curcpu->c_number];
+	tlb_nextvictim[curcpu->c_number] = (victim + 1) % NUM_TLB;
+	tlb_write(ehi, elo, victim);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+
+	splx(spl);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+
+	if (ts->ts_done != NULL) {
+		V(ts->ts_done);
+	}
+}
+
+/*
+ * Without ASIDs we can't tell whose translation for VADDR another CPU
+ * holds, so this hits every CPU's entry for VADDR whichever address
+ * space it belongs to. That costs the innocent ones a TLB reload at
+ * worst.
+ *
+ * Waits until every CPU has acknowledged. Because shootdowns are done
+ * one at a time, no CPU ever has more than one of ours queued and the
+ * queue can't overflow into TLBSHOOTDOWN_ALL, which would lose the
+ * acknowledgement.
+ */
+void
+vm_tlbshootdown_vaddr(vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	unsigned n;
+
+	ts.ts_addrspace = NULL;
+	ts.ts_vaddr = vaddr;
+	ts.ts_done = NULL;
+
+	lock_acquire(tlb_shootdownlock);
+
+	vm_tlbshootdown(&ts);
+
+	ts.ts_done = tlb_donesem;
+	n = ipi_tlbshootdown_broadcast(&ts);
+	while (n-- > 0) {
+		P(tlb_donesem);
+	}
+
+	lock_release(tlb_shootdownlock);
+}
+
+/*
+ * Give the current process its own copy of the copy-on-write page
+ * VADDR, mapped by PTE, whose frame the caller has pinned. If nobody
+ * else shares the frame any more it is simply taken over. Either way
+ * the frame *PTE maps on return is pinned and the old one is not.
+ */
+static
+int
+vm_breakcow(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	paddr_t oldpa, newpa;
+
+	KASSERT(*pte & PTE_COW);
+
+	oldpa = PTE_FRAME(*pte);
+	if (coremap_refcount(oldpa) == 1) {
+		*pte &= ~(pte_t)PTE_COW;
+		coremap_setowner(oldpa, as, vaddr);
+		return 0;
+	}
+
+	newpa = coremap_alloc_upage(as, vaddr);
+	if (newpa == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpa),
+		(const void *)PADDR_TO_KVADDR(oldpa), PAGE_SIZE);
+	*pte = PTE_MAKE(newpa, PTE_VALID);
+	coremap_release(oldpa, as);
+	return 0;
+}
+
+/*
+ * Bring page VADDR of region RG, which is not resident, into memory:
+ * from swap if it was evicted, otherwise from the executable or as
+ * zeros. Leaves the new frame pinned.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	  pte_t *pte)
+{
+	paddr_t paddr;
+	unsigned slot;
+	int result;
+
+	paddr = coremap_alloc_upage(as, vaddr);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	if (*pte & PTE_SWAPPED) {
+		slot = PTE_SWAPSLOT(*pte);
+		result = swap_in(slot, paddr);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		swap_free(slot);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+	else {
+		result = as_loadpage(as, rg, vaddr, paddr);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+	}
+
+	*pte = PTE_MAKE(paddr, PTE_VALID);
+	return 0;
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct region *rg;
+	pte_t *pte;
+	paddr_t paddr;
+	uint32_t ehi, elo;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	rg = as_findregion(as, faultaddress);
+	if (rg == NULL) {
+		return EFAULT;
+	}
+	if (faulttype == VM_FAULT_READONLY && !rg->rg_writeable) {
+		/* Write to a page of a read-only segment. */
+		return EFAULT;
+	}
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+
+	if (faulttype != VM_FAULT_READONLY) {
+		/* a genuine TLB miss, not a write-protect trap */
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	if (pt_pin(pte)) {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+	}
+	else {
+		result = vm_pagein(as, rg, faultaddress, pte);
+		if (result) {
+			return result;
+		}
+	}
+
+	/*
+	 * A write needs a page of our own. So does a read once the
+	 * other sharers are gone, if the coremap lost track of who they
+	 * were: the pager can't evict a frame until it has an owner.
+	 * Taking it over costs nothing then. Read-only pages shared
+	 * without copy-on-write get an owner back the same way.
+	 */
+	if ((*pte & PTE_COW) && (faulttype != VM_FAULT_READ ||
+				 coremap_refcount(PTE_FRAME(*pte)) == 1)) {
+		result = vm_breakcow(as, faultaddress, pte);
+		if (result) {
+			coremap_unpin(PTE_FRAME(*pte));
+			return result;
+		}
+	}
+	else if ((*pte & PTE_COW) == 0) {
+		coremap_adopt(PTE_FRAME(*pte), as, faultaddress);
+	}
+	paddr = PTE_FRAME(*pte);
+
+	ehi = faultaddress;
+	elo = paddr | TLBLO_VALID;
+	if (rg->rg_writeable && (*pte & PTE_COW) == 0) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_insert(ehi, elo);
+	coremap_unpin(paddr);
+	return 0;
+}
+
+void
+as_activate(void)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/* Kernel threads don't have an address space to activate */
+		return;
+	}
+
+	/* No ASIDs; just throw away everyone else's translations. */
+	vm_tlbshootdown_all();
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
+}
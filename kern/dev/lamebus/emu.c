@@ -479,11 +479,17 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -29,15 +29,28 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * I/O requests (struct devreq) are queued and run back to back: the
+ * interrupt handler that finishes one starts the next, so the disk
+ * doesn't sit idle waiting for a thread to be scheduled. Which one
+ * goes next is up to a C-SCAN disk scheduler (see <disksched.h>),
+ * which hands out requests for consecutive sectors together. The disk
+ * only transfers one sector at a time, so a request for several
+ * sectors is run as that many transfers, also driven from the
+ * interrupt handler. lh_lock protects the queue and the active
+ * request.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
+#include <disksched.h>
 #include <lamebus/lhd.h>
 #include "autoconf.h"
 
@@ -95,15 +108,128 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the transfer of the next sector of the active request.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct devreq *req = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(req != NULL);
+	KASSERT(lh->lh_activesect < req->dr_nblocks);
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (req->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->dr_data + lh->lh_activesect * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->dr_block + lh->lh_activesect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, start on the next request the scheduler
+ * gives us.
+ */
+static
+void
+lhd_startnext(struct lhd_softc *lh)
+{
+	struct devreq *req;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL) {
+		return;
+	}
+
+	req = disksched_next(lh->lh_sched);
+	if (req == NULL) {
+		return;
+	}
+
+	lh->lh_active = req;
+	lh->lh_activesect = 0;
+	lhd_startsector(lh);
+}
+
+/*
+ * Record that a sector transfer has completed. If that was the last
+ * sector of the request, or it failed, the request is finished: save
+ * the result, start the next request - the next one merged with it,
+ * if any, otherwise whatever the scheduler chooses - and then tell
+ * whoever submitted this one.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *req, *merged;
+	void (*callback)(struct devreq *);
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_active;
+	if (req == NULL) {
+		/* Nothing was running; ignore it. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (err == 0 && !req->dr_write) {
+		memcpy((char *)req->dr_data + lh->lh_activesect * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_activesect++;
+
+	if (err == 0 && lh->lh_activesect < req->dr_nblocks) {
+		lhd_startsector(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Once dr_complete is set a waiter may return and free the
+	 * request, so fetch what we need from it first.
+	 */
+	callback = req->dr_callback;
+	merged = req->dr_merged;
+	lh->lh_active = NULL;
+	req->dr_result = err;
+	req->dr_complete = true;
+
+	if (merged != NULL) {
+		lh->lh_active = merged;
+		lh->lh_activesect = 0;
+		lhd_startsector(lh);
+	}
+	else {
+		lhd_startnext(lh);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	if (callback != NULL) {
+		callback(req);
+	}
+	else {
+		wchan_wakeall(lh->lh_wchan);
+	}
 }
 
 /*
@@ -193,21 +319,84 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue an asynchronous request.
+ */
+static
+int
+lhd_submit(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow I/O past the end of the disk. */
+	if (req->dr_nblocks == 0 ||
+	    req->dr_block + req->dr_nblocks > lh->lh_dev.d_blocks ||
+	    req->dr_block + req->dr_nblocks < req->dr_block) {
+		return EINVAL;
+	}
+
+	req->dr_complete = false;
+	req->dr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+	disksched_add(lh->lh_sched, req);
+	lhd_startnext(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * Wait for a request submitted without a callback to finish.
+ */
+static
+void
+lhd_wait(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	KASSERT(req->dr_callback == NULL);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!req->dr_complete) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Transfer this many sectors at a time in lhd_io: as many as the
+ * disk scheduler will merge into one run.
+ */
+#define LHD_IOSECTS  DISKSCHED_MAXMERGE
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * The uio may point into userspace, which the interrupt handler can't
+ * get at, so the data goes through a kernel buffer and is handed to
+ * the disk as a series of requests. If memory is short, as it may be
+ * when the VM system is writing pages out to make room, the buffer is
+ * the device's own one-sector lh_iobuf instead, which is slow but
+ * never fails.
  */
 static
 int
 lhd_io(struct device *d, struct uio *uio)
 {
 	struct lhd_softc *lh = d->d_data;
+	struct devreq req;
+	char *buf;
+	uint32_t bufsects;
 
 	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	uint32_t i, n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +409,63 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	bufsects = len < LHD_IOSECTS ? len : LHD_IOSECTS;
+	buf = kmalloc(bufsects * LHD_SECTSIZE);
+	if (buf == NULL) {
+		lock_acquire(lh->lh_iolock);
+		buf = lh->lh_iobuf;
+		bufsects = 1;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	/* Loop over all the sectors we were asked to do. */
+	result = 0;
+	for (i=0; i<len && result == 0; i += n) {
+		n = len - i < bufsects ? len - i : bufsects;
 
 		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
+		 * Are we writing? If so, get the data.
 		 */
 		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			result = uiomove(buf, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+		req.dr_block = sector + i;
+		req.dr_nblocks = n;
+		req.dr_data = buf;
+		req.dr_write = (uio->uio_rw == UIO_WRITE);
+		req.dr_callback = NULL;
+		req.dr_arg = NULL;
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+		result = lhd_submit(d, &req);
+		if (result) {
+			break;
+		}
+		lhd_wait(d, &req);
+		result = req.dr_result;
 
 		/*
 		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
+		 * hand back the data.
 		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (result == 0 && uio->uio_rw == UIO_READ) {
+			result = uiomove(buf, n * LHD_SECTSIZE, uio);
 		}
 	}
 
-	return 0;
+	if (buf == lh->lh_iobuf) {
+		lock_release(lh->lh_iolock);
+	}
+	else {
+		kfree(buf);
+	}
+	return result;
 }
 
 /*
@@ -289,23 +482,33 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		return ENOMEM;
+	}
+	lh->lh_iolock = lock_create(name);
+	if (lh->lh_iolock == NULL) {
+		wchan_destroy(lh->lh_wchan);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	lh->lh_sched = disksched_create(name, &disksched_cscan);
+	if (lh->lh_sched == NULL) {
+		lock_destroy(lh->lh_iolock);
+		wchan_destroy(lh->lh_wchan);
 		return ENOMEM;
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_active = NULL;
+	lh->lh_activesect = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
+	lh->lh_dev.d_submit = lhd_submit;
+	lh->lh_dev.d_wait = lhd_wait;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
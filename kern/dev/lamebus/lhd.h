@@ -30,8 +30,12 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
+struct disksched;  /* in <disksched.h> */
+struct lock;       /* in <synch.h> */
+
 /*
  * Our sector size
  */
@@ -51,9 +55,15 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct disksched *lh_sched;	/* Requests not yet started */
+	struct devreq *lh_active;	/* Request the disk is working on */
+	uint32_t lh_activesect;		/* Sectors of it done so far */
+	struct wchan *lh_wchan;		/* Threads waiting in lhd_wait */
+
+	/* For lhd_io when it can't get a buffer of its own */
+	struct lock *lh_iolock;		/* Protects lh_iobuf */
+	char lh_iobuf[LHD_SECTSIZE];
 
 	struct device lh_dev;		/* VFS device structure */
 };
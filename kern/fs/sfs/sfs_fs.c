@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -101,6 +103,29 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Free a struct sfs_fs and whatever of its contents has been set up.
+ */
+static
+void
+sfs_fs_destroy(struct sfs_fs *sfs)
+{
+	if (sfs->sfs_freemap != NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+	}
+	if (sfs->sfs_freemaplock != NULL) {
+		lock_destroy(sfs->sfs_freemaplock);
+	}
+	if (sfs->sfs_vnhash != NULL) {
+		KASSERT(sfs->sfs_nvnodes == 0);
+		kfree(sfs->sfs_vnhash);
+	}
+	if (sfs->sfs_vnlock != NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+	}
+	kfree(sfs);
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +136,11 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct sfs_vnode *sv;
+	struct vnodearray *vnodes;
 	unsigned i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +173,54 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Take a reference to each loaded vnode and sync their inodes
+	 * after letting go of sfs_vnlock: that needs the vnode's own
+	 * lock, and for a directory that comes first. Not VOP_FSYNC,
+	 * which would also run buf_sync for each of them; that is done
+	 * once, at the end.
+	 */
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+	lock_acquire(sfs->sfs_vnlock);
+	result = vnodearray_setsize(vnodes, sfs->sfs_nvnodes);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	num = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_v);
+			vnodearray_set(vnodes, num++, &sv->sv_v);
+		}
+	}
+	KASSERT(num == sfs->sfs_nvnodes);
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		struct vnode *v = vnodearray_get(vnodes, i);
+
+		sv = v->vn_data;
+		lock_acquire(sv->sv_lock);
+		sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+
+	lock_acquire(sfs->sfs_freemaplock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,51 +230,54 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* All of the above only went as far as the buffer cache. */
+	return buf_sync(sfs->sfs_device);
 }
 
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
  * of the device they're mounted on.
+ *
+ * The name never changes after mount, so no locking is needed.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
-
-	return ret;
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
  * Unmount code.
  *
- * VFS calls FS_SYNC on the filesystem prior to unmounting it.
+ * VFS calls FS_SYNC on the filesystem prior to unmounting it. It
+ * holds vfs_biglock throughout, so nothing new can be looked up on
+ * the filesystem meanwhile.
  */
 static
 int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	unsigned num;
+	int result;
 
-	vfs_biglock_acquire();
-	
 	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	lock_release(sfs->sfs_vnlock);
+	if (num > 0) {
 		return EBUSY;
 	}
 
@@ -221,18 +285,27 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Make sure nothing was dirtied since, though. */
+	result = buf_sync(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
+	/* Drop our buffers, once any the syncer has busy come back. */
+	result = buf_invalidate(sfs->sfs_device);
+	if (result) {
+		return result;
+	}
+
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
-	bitmap_destroy(sfs->sfs_freemap);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
 
 	/* Destroy the fs object */
-	kfree(sfs);
+	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -254,11 +327,10 @@ static
 int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
+	unsigned i;
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -268,6 +340,7 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	KASSERT(SFS_BLOCKSIZE == BUF_BLOCKSIZE);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
@@ -278,22 +351,40 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
-
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		kfree(sfs);
-		vfs_biglock_release();
+	sfs->sfs_vnlock = NULL;
+	sfs->sfs_vnhash = NULL;
+	sfs->sfs_vnhashsize = 0;
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_freemaplock = NULL;
+	sfs->sfs_freemap = NULL;
+
+	/* Allocate locks and the vnode table */
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_MINSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		sfs_fs_destroy(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_MINSIZE;
+	for (i=0; i<SFS_VNHASH_MINSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
 
@@ -303,9 +394,8 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		buf_invalidate(dev);
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
@@ -316,12 +406,19 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		buf_invalidate(dev);
+		sfs_fs_destroy(sfs);
 		return EINVAL;
 	}
 	
+	if (sfs->sfs_super.sp_flags & ~SFS_FEAT_ALL) {
+		kprintf("sfs: Unknown features in superblock (0x%x)\n",
+			sfs->sfs_super.sp_flags & ~SFS_FEAT_ALL);
+		buf_invalidate(dev);
+		sfs_fs_destroy(sfs);
+		return EINVAL;
+	}
+
 	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
 			sfs->sfs_super.sp_nblocks, dev->d_blocks);
@@ -333,17 +430,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		buf_invalidate(dev);
+		sfs_fs_destroy(sfs);
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
+		buf_invalidate(dev);
+		sfs_fs_destroy(sfs);
 		return result;
 	}
 
@@ -361,7 +455,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -31,6 +31,12 @@
  * SFS filesystem
  *
  * File-level (vnode) interface routines.
+ *
+ * See sfs.h for what the locks cover and the order to take them in.
+ * Operations on one file hold its sv_lock for their duration, so
+ * I/O on different files proceeds in parallel. Directory operations
+ * hold the directory's lock while they take the lock of a file named
+ * in it.
  */
 #include <types.h>
 #include <kern/errno.h>
@@ -43,12 +49,17 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Below sfs_reclaim */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,16 +69,25 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *b;
+	int result;
+
+	result = buf_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	bzero(buf_map(b), SFS_BLOCKSIZE);
+	buf_markdirty(b);
+	buf_release(b);
+	return 0;
 }
 
 /* Write an on-disk inode structure back out to disk. */
-static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
@@ -79,33 +99,257 @@ sfs_sync_inode(struct sfs_vnode *sv)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Vnode table
+
+/*
+ * Return the chain in sfs_vnhash for inode INO.
+ */
+static
+struct sfs_vnode **
+sfs_vnhash_chain(struct sfs_fs *sfs, uint32_t ino)
+{
+	return &sfs->sfs_vnhash[ino & (sfs->sfs_vnhashsize - 1)];
+}
+
+/*
+ * Double the number of chains. If there isn't memory for it, carry
+ * on with longer chains.
+ */
+static
+void
+sfs_vnhash_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **oldhash, *sv;
+	unsigned oldsize, i;
+
+	oldhash = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashsize;
+
+	sfs->sfs_vnhash = kmalloc(2 * oldsize * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		sfs->sfs_vnhash = oldhash;
+		return;
+	}
+	sfs->sfs_vnhashsize = 2 * oldsize;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+
+	for (i=0; i<oldsize; i++) {
+		while (oldhash[i] != NULL) {
+			sv = oldhash[i];
+			oldhash[i] = sv->sv_hashnext;
+			sv->sv_hashnext = *sfs_vnhash_chain(sfs, sv->sv_ino);
+			*sfs_vnhash_chain(sfs, sv->sv_ino) = sv;
+		}
+	}
+	kfree(oldhash);
+}
+
+/*
+ * Find the loaded vnode for inode INO, or return NULL.
+ */
+static
+struct sfs_vnode *
+sfs_vnhash_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = *sfs_vnhash_chain(sfs, ino); sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a vnode to the table.
+ */
+static
+void
+sfs_vnhash_insert(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **chain;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	if (sfs->sfs_nvnodes >= SFS_VNHASH_LOAD * sfs->sfs_vnhashsize) {
+		sfs_vnhash_grow(sfs);
+	}
+
+	chain = sfs_vnhash_chain(sfs, sv->sv_ino);
+	sv->sv_hashnext = *chain;
+	*chain = sv;
+	sfs->sfs_nvnodes++;
+}
+
+/*
+ * Remove a vnode from the table.
+ */
+static
+void
+sfs_vnhash_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (svp = sfs_vnhash_chain(sfs, sv->sv_ino); *svp != sv;
+	     svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: vnode %u not in vnode table\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block: the first free one at or after GOAL.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_near(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
-	/* Clear block before returning it */
+	/* Clear block before returning it; nobody else can see it yet */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Give back the blocks reserved for a file that it didn't use.
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_pacount == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<sv->sv_pacount; i++) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_pastart + i);
+	}
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+	sv->sv_pacount = 0;
+}
+
+/*
+ * Allocate a block for a file, to go after the file's block PREV. If
+ * PREV is 0, it goes wherever the file's blocks are being allocated
+ * at the moment, or after the inode if nowhere yet.
+ *
+ * So that files written at the same time don't end up interleaved
+ * block by block, each allocation that isn't the next block of the
+ * file's reservation also reserves the free blocks directly after
+ * it, up to sv_pawindow in all. The file's next blocks come from
+ * there as long as they are written in order. Reserved blocks are
+ * marked in use in the freemap; they go back when the file is
+ * closed, truncated or reclaimed. (If the system crashes first,
+ * sfsck finds them in use but unused and frees them.)
+ *
+ * When a file uses up its reservation in order, the next one starts
+ * right after it if that block is free, so the file's last run of
+ * blocks just grows; either way the window doubles, up to
+ * SFS_PREALLOCMAX. Then a big file written alongside others is in
+ * a few big pieces rather than many SFS_PREALLOC-block ones.
+ */
+static
+int
+sfs_fballoc(struct sfs_vnode *sv, uint32_t prev, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t goal, block;
+	unsigned n;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	goal = (prev != 0 ? prev : sv->sv_ino) + 1;
+
+	if (sv->sv_pacount > 0 && (prev == 0 || sv->sv_pastart == goal)) {
+		/* Next in the reservation; just take it. */
+		block = sv->sv_pastart;
+		sv->sv_pastart++;
+		sv->sv_pacount--;
+	}
+	else {
+		/* Somewhere else; start a new reservation there. */
+		if (sv->sv_pacount == 0 && prev != 0 &&
+		    sv->sv_pastart == goal) {
+			/* Used the last one up in order */
+			if (sv->sv_pawindow < SFS_PREALLOCMAX) {
+				sv->sv_pawindow *= 2;
+			}
+		}
+		else {
+			sv->sv_pawindow = SFS_PREALLOC;
+		}
+		sfs_prealloc_release(sv);
+
+		lock_acquire(sfs->sfs_freemaplock);
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, &block);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		for (n=1; n<sv->sv_pawindow; n++) {
+			if (block + n >= sfs->sfs_super.sp_nblocks ||
+			    bitmap_isset(sfs->sfs_freemap, block + n)) {
+				break;
+			}
+			bitmap_mark(sfs->sfs_freemap, block + n);
+		}
+		sfs->sfs_freemapdirty = true;
+		lock_release(sfs->sfs_freemaplock);
+
+		sv->sv_pastart = block + 1;
+		sv->sv_pacount = n - 1;
+	}
+
+	if (block >= sfs->sfs_super.sp_nblocks) {
+		panic("sfs: fballoc: invalid block %u\n", block);
+	}
+
+	*diskblock = block;
+
+	/* Clear block before returning it; nobody else can see it yet */
+	return sfs_clearblock(sfs, block);
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +357,10 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,17 +370,424 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int result;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return result;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * True if the filesystem's inodes use extents.
+ */
+static
+bool
+sfs_isext(struct sfs_fs *sfs)
+{
+	return (sfs->sfs_super.sp_flags & SFS_FEAT_EXTENTS) != 0;
+}
+
+/*
+ * Get SV's extent block, if it has one, in *XBUF; otherwise set
+ * *XBUF to NULL. Give it back with sfs_ext_unload.
+ */
+static
+int
+sfs_ext_load(struct sfs_vnode *sv, struct buf **xbuf)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	*xbuf = NULL;
+	if (sv->sv_i.sfi_extblock == 0) {
+		return 0;
+	}
+	return buf_read(sfs->sfs_device, sv->sv_i.sfi_extblock, xbuf);
+}
+
+/*
+ * Give back the extent block XBUF from sfs_ext_load, marking it dirty
+ * if DIRTY is set. If no extents are left in it, free it instead.
+ */
+static
+void
+sfs_ext_unload(struct sfs_vnode *sv, struct buf *xbuf, bool dirty)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extent *xext;
+
+	if (xbuf == NULL) {
+		return;
+	}
+	xext = buf_map(xbuf);
+	if (xext[0].sfe_len == 0) {
+		buf_release(xbuf);
+		sfs_bfree(sfs, sv->sv_i.sfi_extblock);
+		sv->sv_i.sfi_extblock = 0;
+		sv->sv_dirty = true;
+		return;
+	}
+	if (dirty) {
+		buf_markdirty(xbuf);
+	}
+	buf_release(xbuf);
+}
+
+/*
+ * Number of extents SV has room for: those in the inode, and those
+ * in the extent block if XBUF isn't NULL.
+ */
+static
+unsigned
+sfs_ext_nslots(struct buf *xbuf)
+{
+	return SFS_NEXTENTS + (xbuf != NULL ? SFS_XEXTENTS : 0);
+}
+
+/*
+ * Extent I of SV: in the inode, or past SFS_NEXTENTS, in the extent
+ * block XBUF.
+ */
+static
+struct sfs_extent *
+sfs_ext_get(struct sfs_vnode *sv, struct buf *xbuf, unsigned i)
+{
+	struct sfs_extent *xext;
+
+	if (i < SFS_NEXTENTS) {
+		return &sv->sv_i.sfi_extents[i];
+	}
+	KASSERT(xbuf != NULL);
+	KASSERT(i < SFS_NEXTENTS + SFS_XEXTENTS);
+	xext = buf_map(xbuf);
+	return &xext[i - SFS_NEXTENTS];
+}
+
+/*
+ * Find the extent of SV holding file block FILEBLOCK. Sets *IDX to
+ * its index and *OFF to the block's offset in it, and returns true.
+ * If the file's extents end before FILEBLOCK, returns false with
+ * *IDX the number of extents in use and *OFF the number of blocks
+ * between their end and FILEBLOCK. XBUF is from sfs_ext_load.
+ */
+static
+bool
+sfs_ext_find(struct sfs_vnode *sv, struct buf *xbuf, uint32_t fileblock,
+	     unsigned *idx, uint32_t *off)
+{
+	struct sfs_extent *e;
+	unsigned i, nslots;
+
+	nslots = sfs_ext_nslots(xbuf);
+	for (i=0; i<nslots; i++) {
+		e = sfs_ext_get(sv, xbuf, i);
+		if (e->sfe_len == 0) {
+			break;
+		}
+		if (fileblock < e->sfe_len) {
+			*idx = i;
+			*off = fileblock;
+			return true;
+		}
+		fileblock -= e->sfe_len;
+	}
+	*idx = i;
+	*off = fileblock;
+	return false;
+}
+
+/*
+ * Add LEN blocks at START (or a hole, if START is 0) to the end of
+ * the list of *N extents in EXTS, merging them into the last extent
+ * if they carry on from it.
+ */
+static
+void
+sfs_ext_append(struct sfs_extent *exts, unsigned *n, uint32_t start,
+	       uint32_t len)
+{
+	struct sfs_extent *last;
+
+	if (len == 0) {
+		return;
+	}
+	if (*n > 0) {
+		last = &exts[*n - 1];
+		if ((last->sfe_start == 0 && start == 0) ||
+		    (last->sfe_start != 0 &&
+		     last->sfe_start + last->sfe_len == start)) {
+			last->sfe_len += len;
+			return;
+		}
+	}
+	exts[*n].sfe_start = start;
+	exts[*n].sfe_len = len;
+	(*n)++;
+}
+
+/*
+ * Record that file block FILEBLOCK of SV, which is a hole or past the
+ * end of the extents, is now at disk block BLOCK. Only the extent it
+ * is in and the ones on either side, which it might merge with, can
+ * change; build those on the side, then slide the rest along to fit.
+ * The extent block is started when the inode fills up; fail with
+ * EFBIG if that fills up too.
+ */
+static
+int
+sfs_ext_set(struct sfs_vnode *sv, uint32_t fileblock, uint32_t block)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *xbuf;
+	struct sfs_extent newext[5], *e;
+	unsigned idx, lo, hi, count, newcount, i, n;
+	uint32_t off, xblock;
+	bool found;
+	int result;
+
+	result = sfs_ext_load(sv, &xbuf);
+	if (result) {
+		return result;
+	}
+
+	found = sfs_ext_find(sv, xbuf, fileblock, &idx, &off);
+	count = idx;
+	while (count < sfs_ext_nslots(xbuf) &&
+	       sfs_ext_get(sv, xbuf, count)->sfe_len > 0) {
+		count++;
+	}
+
+	lo = idx > 0 ? idx - 1 : 0;
+	hi = found && idx + 2 < count ? idx + 2 : count;
+	n = 0;
+	for (i=lo; i<idx; i++) {
+		e = sfs_ext_get(sv, xbuf, i);
+		sfs_ext_append(newext, &n, e->sfe_start, e->sfe_len);
+	}
+	sfs_ext_append(newext, &n, 0, off);
+	sfs_ext_append(newext, &n, block, 1);
+	if (found) {
+		e = sfs_ext_get(sv, xbuf, idx);
+		KASSERT(e->sfe_start == 0);
+		sfs_ext_append(newext, &n, 0, e->sfe_len - off - 1);
+	}
+	for (i=idx+1; i<hi; i++) {
+		e = sfs_ext_get(sv, xbuf, i);
+		sfs_ext_append(newext, &n, e->sfe_start, e->sfe_len);
+	}
+	newcount = count - (hi - lo) + n;
+
+	if (newcount > sfs_ext_nslots(xbuf)) {
+		if (xbuf != NULL) {
+			sfs_ext_unload(sv, xbuf, false);
+			return EFBIG;
+		}
+		/* Start the extent block, near the inode */
+		result = sfs_balloc(sfs, sv->sv_ino, &xblock);
+		if (result) {
+			return result;
+		}
+		result = buf_read(sfs->sfs_device, xblock, &xbuf);
+		if (result) {
+			sfs_bfree(sfs, xblock);
+			return result;
+		}
+		sv->sv_i.sfi_extblock = xblock;
+	}
+
+	/* Slide the extents after the changed ones along */
+	if (lo + n > hi) {
+		for (i=count; i-- > hi; ) {
+			*sfs_ext_get(sv, xbuf, i + (lo + n - hi)) =
+				*sfs_ext_get(sv, xbuf, i);
+		}
+	}
+	else if (lo + n < hi) {
+		for (i=hi; i<count; i++) {
+			*sfs_ext_get(sv, xbuf, i - (hi - lo - n)) =
+				*sfs_ext_get(sv, xbuf, i);
+		}
+		for (i=newcount; i<count; i++) {
+			e = sfs_ext_get(sv, xbuf, i);
+			e->sfe_start = 0;
+			e->sfe_len = 0;
+		}
+	}
+	for (i=0; i<n; i++) {
+		*sfs_ext_get(sv, xbuf, lo + i) = newext[i];
+	}
+
+	sv->sv_dirty = true;
+	sfs_ext_unload(sv, xbuf, true);
+	return 0;
+}
+
+/*
+ * sfs_bmap for a file with extents. Also hands back in *RUN (if not
+ * NULL) how many blocks from FILEBLOCK on are in the same extent, so
+ * they are contiguous on disk or all holes.
+ */
+static
+int
+sfs_ext_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	     uint32_t *diskblock, uint32_t *run)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *xbuf;
+	struct sfs_extent *e;
+	unsigned idx;
+	uint32_t off, block, prev;
+	bool found;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	result = sfs_ext_load(sv, &xbuf);
+	if (result) {
+		return result;
+	}
+
+	found = sfs_ext_find(sv, xbuf, fileblock, &idx, &off);
+	e = found ? sfs_ext_get(sv, xbuf, idx) : NULL;
+	if (e != NULL && e->sfe_start != 0) {
+		*diskblock = e->sfe_start + off;
+		if (run != NULL) {
+			*run = e->sfe_len - off;
+		}
+		sfs_ext_unload(sv, xbuf, false);
+		return 0;
+	}
+
+	if (!doalloc) {
+		*diskblock = 0;
+		if (run != NULL) {
+			*run = e != NULL ? e->sfe_len - off : 1;
+		}
+		sfs_ext_unload(sv, xbuf, false);
+		return 0;
+	}
+
+	/*
+	 * Allocate it. If the block before it in the file is at the
+	 * end of the previous extent, try to put it after that, so
+	 * the extent just grows.
+	 */
+	prev = 0;
+	if (off == 0 && idx > 0) {
+		e = sfs_ext_get(sv, xbuf, idx - 1);
+		if (e->sfe_start != 0) {
+			prev = e->sfe_start + e->sfe_len - 1;
+		}
+	}
+	sfs_ext_unload(sv, xbuf, false);
+
+	result = sfs_fballoc(sv, prev, &block);
+	if (result) {
+		return result;
+	}
+	result = sfs_ext_set(sv, fileblock, block);
+	if (result) {
+		sfs_bfree(sfs, block);
+		return result;
+	}
+
+	*diskblock = block;
+	if (run != NULL) {
+		*run = 1;
+	}
+	return 0;
+}
+
+/*
+ * sfs_dotruncate for a file with extents: discard blocks BLOCKLEN
+ * and up, and the extent block if no extents are left in it.
+ */
+static
+int
+sfs_ext_truncate(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *xbuf;
+	struct sfs_extent *e;
+	uint32_t base, keep, j;
+	unsigned i, n, nslots;
+	bool xdirty;
+	int result;
+
+	result = sfs_ext_load(sv, &xbuf);
+	if (result) {
+		return result;
+	}
+	nslots = sfs_ext_nslots(xbuf);
+
+	base = 0;
+	n = 0;
+	xdirty = false;
+	for (i=0; i<nslots; i++) {
+		e = sfs_ext_get(sv, xbuf, i);
+		if (e->sfe_len == 0) {
+			break;
+		}
+		keep = 0;
+		if (base < blocklen) {
+			keep = blocklen - base;
+			if (keep > e->sfe_len) {
+				keep = e->sfe_len;
+			}
+		}
+		base += e->sfe_len;
+
+		if (keep < e->sfe_len) {
+			if (e->sfe_start != 0) {
+				for (j=keep; j<e->sfe_len; j++) {
+					sfs_bfree(sfs, e->sfe_start + j);
+				}
+			}
+			e->sfe_len = keep;
+			if (keep == 0) {
+				e->sfe_start = 0;
+			}
+			if (i < SFS_NEXTENTS) {
+				sv->sv_dirty = true;
+			}
+			else {
+				xdirty = true;
+			}
+		}
+		if (keep > 0 && e->sfe_start != 0) {
+			/* Last extent with blocks in it so far */
+			n = i + 1;
+		}
+	}
+
+	/* Holes at the end don't need to be recorded. */
+	for (i=n; i<nslots; i++) {
+		e = sfs_ext_get(sv, xbuf, i);
+		if (e->sfe_len == 0) {
+			break;
+		}
+		e->sfe_start = 0;
+		e->sfe_len = 0;
+		if (i < SFS_NEXTENTS) {
+			sv->sv_dirty = true;
+		}
+		else {
+			xdirty = true;
+		}
+	}
+
+	sfs_ext_unload(sv, xbuf, xdirty);
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
@@ -146,22 +799,21 @@ int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t *rootp;
+	uint32_t block, parent, prev;
+	uint32_t offset, span, idoff;
+	unsigned levels;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sfs_isext(sfs)) {
+		return sfs_ext_bmap(sv, fileblock, doalloc, diskblock, NULL);
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +828,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_fballoc(sv, fileblock > 0 ?
+					     sv->sv_i.sfi_direct[fileblock-1] : 0,
+					     &block);
 			if (result) {
 				return result;
 			}
@@ -198,90 +852,124 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block, so it's in one of the trees of
+	 * indirect blocks: the indirect block, the doubly indirect
+	 * block or the triply indirect block. Find which, and how
+	 * many levels deep it goes, and set OFFSET to the block's
+	 * offset within it. SPAN is the number of blocks in the tree.
 	 */
-	if (idnum > 0) {
-		return EFBIG;
+	offset = fileblock - SFS_NDIRECT;
+	span = SFS_DBPERIDB;
+	if (offset < span) {
+		rootp = &sv->sv_i.sfi_indirect;
+		levels = 1;
+		/* It goes after the last direct block. */
+		prev = sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+	}
+	else {
+		offset -= span;
+		span *= SFS_DBPERIDB;
+		if (offset < span) {
+			rootp = &sv->sv_i.sfi_dindirect;
+			levels = 2;
+		}
+		else {
+			offset -= span;
+			span *= SFS_DBPERIDB;
+			if (offset >= span) {
+				/* Past the end of the triply indirect block. */
+				return EFBIG;
+			}
+			rootp = &sv->sv_i.sfi_tindirect;
+			levels = 3;
+		}
+		prev = 0;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
+	/* Get the top block of the tree. */
+	block = *rootp;
+	if (block==0 && !doalloc) {
 		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
+		 * There's no tree. We weren't asked to allocate
+		 * anything, so pretend it was filled with all zeros.
 		 */
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
-		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
-		 */
-		result = sfs_balloc(sfs, &idblock);
+	else if (block==0) {
+		result = sfs_fballoc(sv, prev, &block);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*rootp = block;
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* sfs_fballoc has already cleared it. */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+
+	/*
+	 * Walk down the tree. Each entry in a block at the current
+	 * level covers SPAN/SFS_DBPERIDB of the tree's blocks.
+	 */
+	while (levels > 0) {
+		span /= SFS_DBPERIDB;
+		idoff = offset / span;
+		offset %= span;
+		levels--;
+
+		/* Load the indirect block. */
+		result = buf_read(sfs->sfs_device, block, &idbuf);
 		if (result) {
 			return result;
 		}
-	}
+		iddata = buf_map(idbuf);
+
+		/* Get the next block down out of it */
+		parent = block;
+		block = iddata[idoff];
+
+		/*
+		 * If there's no block there, allocate one. A data
+		 * block goes after the one before it or, for the
+		 * first, after the indirect block that lists it. An
+		 * indirect block just goes wherever the file is
+		 * being allocated.
+		 */
+		if (block==0 && doalloc) {
+			if (levels == 0) {
+				prev = idoff > 0 ? iddata[idoff-1] : parent;
+			}
+			else {
+				prev = 0;
+			}
+			result = sfs_fballoc(sv, prev, &block);
+			if (result) {
+				buf_release(idbuf);
+				return result;
+			}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+			/* Remember the block we allocated */
+			iddata[idoff] = block;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
-		if (result) {
-			return result;
+			/* The indirect block is now dirty */
+			buf_markdirty(idbuf);
 		}
+		buf_release(idbuf);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		if (block == 0) {
+			/* Nothing here, and we weren't asked to allocate */
+			KASSERT(!doalloc);
+			*diskblock = 0;
+			return 0;
 		}
 	}
 
 	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
+	if (!sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
 		      block, fileblock, sv->sv_ino);
 	}
@@ -297,7 +985,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
  * we don't clobber the portion of the block we're not intending to
- * write over.
+ * write over - unless none of that portion is inside the file, in
+ * which case it can just be zeros.
  *
  * skipstart is the number of bytes to skip past at the beginning of
  * the sector; len is the number of bytes to actually read or write.
@@ -308,18 +997,11 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	off_t inuse;
 	int result;
 	
 	/* Allocate missing blocks if and only if we're writing */
@@ -339,68 +1021,140 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache. When writing, see how
+	 * much of the block is before EOF; if we're overwriting all
+	 * of that, what's on disk doesn't matter. This is the case
+	 * for the first write to each block while appending.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	inuse = 0;
+	if (uio->uio_rw == UIO_WRITE) {
+		inuse = (off_t)sv->sv_i.sfi_size
+			- (off_t)fileblock * SFS_BLOCKSIZE;
+	}
+	if (uio->uio_rw == UIO_WRITE &&
+	    (inuse <= 0 || (skipstart == 0 && len >= inuse))) {
+		result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buf_read(sfs->sfs_device, diskblock, &iobuf);
+	}
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the block is now dirty - even if uiomove
+	 * failed partway, since some of it may have been changed.
 	 */
+	result = uiomove((char *)buf_map(iobuf) + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		buf_markdirty(iobuf);
+	}
+	buf_release(iobuf);
+
+	return result;
+}
+
+/*
+ * Like sfs_bmap, but also hand back in *RUN how many blocks from
+ * FILEBLOCK on are known to follow on from it: at consecutive disk
+ * blocks, or all unallocated if *DISKBLOCK is 0. With extents that
+ * is the rest of the extent, so a sequential transfer needs one
+ * lookup per extent. Otherwise, when reading, look ahead at up to
+ * MAXRUN blocks to see how many are contiguous; these lookups are
+ * cheap, since they hit the same cached indirect block.
+ */
+static
+int
+sfs_bmaprun(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	    uint32_t maxrun, uint32_t *diskblock, uint32_t *run)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t next;
+	int result;
+
+	KASSERT(maxrun > 0);
+
+	if (sfs_isext(sfs)) {
+		return sfs_ext_bmap(sv, fileblock, doalloc, diskblock, run);
 	}
 
+	result = sfs_bmap(sv, fileblock, doalloc, diskblock);
+	if (result) {
+		return result;
+	}
+	*run = 1;
+	if (doalloc || *diskblock == 0) {
+		return 0;
+	}
+	while (*run < maxrun) {
+		result = sfs_bmap(sv, fileblock + *run, 0, &next);
+		if (result || next != *diskblock + *run) {
+			/* Errors here can wait until we get to the block. */
+			break;
+		}
+		(*run)++;
+	}
 	return 0;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Read up to N whole blocks, which are at consecutive disk blocks
+ * starting at DISKBLOCK, into UIO. Hands back the number done in
+ * *DONE.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_readrun(struct sfs_vnode *sv, struct uio *uio, uint32_t diskblock,
+	    uint32_t n, uint32_t *done)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
+	struct buf *bufs[BUF_MAXRUN];
+	unsigned got, i;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_rw == UIO_READ);
+	KASSERT(diskblock != 0);
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	if (n > BUF_MAXRUN) {
+		n = BUF_MAXRUN;
+	}
+	result = buf_readrun(sfs->sfs_device, diskblock, n, bufs, &got);
 	if (result) {
 		return result;
 	}
 
+	KASSERT(uio->uio_resid >= got * SFS_BLOCKSIZE);
+	for (i=0; i<got; i++) {
+		if (result == 0) {
+			result = uiomove(buf_map(bufs[i]), SFS_BLOCKSIZE, uio);
+		}
+		buf_release(bufs[i]);
+	}
+	*done = got;
+	return result;
+}
+
+/*
+ * Do I/O (either read or write) of a single whole block, which the
+ * caller has looked up and found at DISKBLOCK.
+ */
+static
+int
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuf;
+	int result;
+
 	if (diskblock == 0) {
 		/*
 		 * No block - fill with zeros.
@@ -413,33 +1167,91 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. If we're writing, the whole
+	 * block is about to be replaced, so there's no need to read
+	 * what was there before.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	if (uio->uio_rw == UIO_READ) {
+		result = buf_read(sfs->sfs_device, diskblock, &iobuf);
+	}
+	else {
+		result = buf_get(sfs->sfs_device, diskblock, &iobuf);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
 	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
-
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	result = uiomove(buf_map(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		buf_markdirty(iobuf);
+	}
+	buf_release(iobuf);
 
 	return result;
 }
 
+/*
+ * Read-ahead.
+ *
+ * A read that starts where the previous one on the vnode left off
+ * (or in the block where it left off, for reads smaller than a block)
+ * is taken to be part of a sequential scan. For those, the next
+ * sv_rawindow blocks of the file past the end of the read are queued
+ * to be read into the buffer cache in the background, so the disk is
+ * busy with them while the caller deals with what it has. The window
+ * starts small and doubles with each further sequential read, up to
+ * SFS_RAMAX blocks; any other read turns read-ahead off again.
+ */
+#define SFS_RAMIN  2
+#define SFS_RAMAX  32
+
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t last)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t fileblocks, start, stop, fb, diskblock;
+
+	if (first == sv->sv_ranext ||
+	    (sv->sv_ranext > 0 && first == sv->sv_ranext - 1)) {
+		if (sv->sv_rawindow == 0) {
+			sv->sv_rawindow = SFS_RAMIN;
+		}
+		else if (sv->sv_rawindow < SFS_RAMAX) {
+			sv->sv_rawindow *= 2;
+		}
+	}
+	else {
+		sv->sv_rawindow = 0;
+		sv->sv_rapos = last + 1;
+	}
+	sv->sv_ranext = last + 1;
+
+	if (sv->sv_rawindow == 0) {
+		return;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+	start = sv->sv_rapos > last + 1 ? sv->sv_rapos : last + 1;
+	stop = last + 1 + sv->sv_rawindow;
+	if (stop > fileblocks) {
+		stop = fileblocks;
+	}
+
+	for (fb = start; fb < stop; fb++) {
+		if (sfs_bmap(sv, fb, 0, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			buf_readahead(sfs->sfs_device, diskblock);
+		}
+	}
+	if (stop > sv->sv_rapos) {
+		sv->sv_rapos = stop;
+	}
+}
+
 /*
  * Do I/O of a whole region of data, whether or not it's block-aligned.
  */
@@ -448,9 +1260,14 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks, i, n;
+	uint32_t firstblock, lastblock;
+	uint32_t diskblock, run;
 	int result = 0;
 	uint32_t extraresid = 0;
+	int doalloc = (uio->uio_rw==UIO_WRITE);
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -473,6 +1290,12 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		}
 	}
 
+	/* Remember which blocks this is for sfs_readahead. */
+	firstblock = uio->uio_offset / SFS_BLOCKSIZE;
+	lastblock = uio->uio_resid > 0 ?
+		(uio->uio_offset + uio->uio_resid - 1) / SFS_BLOCKSIZE :
+		firstblock;
+
 	/*
 	 * First, do any leading partial block.
 	 */
@@ -502,15 +1325,40 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole blocks,
+	 * looking up each run of contiguous ones only once, and reading
+	 * each such run from the disk in one go.
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	run = 0;
+	diskblock = 0;
+	for (i=0; i<nblocks; i+=n) {
+		if (run == 0) {
+			result = sfs_bmaprun(sv,
+					     uio->uio_offset / SFS_BLOCKSIZE,
+					     doalloc, nblocks - i,
+					     &diskblock, &run);
+			if (result) {
+				goto out;
+			}
+			KASSERT(run > 0);
+		}
+		n = run < nblocks - i ? run : nblocks - i;
+		if (uio->uio_rw == UIO_READ && diskblock != 0 && n > 1) {
+			result = sfs_readrun(sv, uio, diskblock, n, &n);
+		}
+		else {
+			n = 1;
+			result = sfs_blockio(sv, uio, diskblock);
+		}
 		if (result) {
 			goto out;
 		}
+		if (diskblock != 0) {
+			diskblock += n;
+		}
+		run -= n;
 	}
 
 	/*
@@ -527,6 +1375,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* If reading, start on what's likely to be wanted next. */
+	if (uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, firstblock, lastblock);
+	}
+
 	/* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
@@ -541,99 +1394,359 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
-////////////////////////////////////////////////////////////
-//
-// Directory I/O
-
+////////////////////////////////////////////////////////////
+//
+// Directory I/O
+
+/*
+ * Read the directory entry out of slot SLOT of a directory vnode.
+ * The "slot" is the index of the directory entry, starting at 0.
+ */
+static
+int
+sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t actualpos;
+	int result;
+
+	/* Compute the actual position in the directory to read. */
+	actualpos = slot * sizeof(struct sfs_dir);
+
+	/* Set up a uio to do the read */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
+
+	/* do it */
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+
+	/* We should not hit EOF in the middle of a directory entry */
+	if (ku.uio_resid > 0) {
+		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Write (overwrite) the directory entry in slot SLOT of a directory
+ * vnode.
+ */
+static
+int
+sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t actualpos;
+	int result;
+
+	/* Compute the actual position in the directory. */
+	KASSERT(slot>=0);
+	actualpos = slot * sizeof(struct sfs_dir);
+
+	/* Set up a uio to do the write */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+
+	/* do it */
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+
+	/* Should not end up with a partial entry! */
+	if (ku.uio_resid > 0) {
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Directory index.
+ *
+ * Without an index, finding a name means reading every slot of the
+ * directory, so lookups, creates and removes in a directory of N
+ * entries each cost O(N). Once a directory has SFS_DIRINDEX_MIN
+ * slots, the first search of it also builds an in-memory index:
+ * the slots holding names are chained by hash of the name, and the
+ * empty slots are kept on a free list, both linked through di_next.
+ * A search then reads only the slots on one chain.
+ *
+ * The index isn't stored on disk, so the disk format is unchanged.
+ * It lasts as long as the vnode, and sfs_dir_link and sfs_dir_unlink
+ * keep it up to date. If it can't be kept up to date (no memory, a
+ * failed write) it is thrown away, and the next search scans the
+ * directory and builds a new one. The same happens once the chains
+ * get long, to rebuild it with more of them.
+ *
+ * It is protected by the directory's sv_lock, like the directory.
+ */
+#define SFS_DIRINDEX_MIN  64
+
+struct sfs_dirindex {
+	unsigned di_nbuckets;	/* number of chains, a power of 2 */
+	int *di_buckets;	/* first slot on each chain, or -1 */
+	int *di_next;		/* next slot on the same chain/free list */
+	unsigned di_nslots;	/* number of slots in the directory */
+	unsigned di_maxslots;	/* size of di_next */
+	int di_free;		/* first empty slot, or -1 */
+};
+
+static
+unsigned
+sfs_dirindex_hash(struct sfs_dirindex *di, const char *name)
+{
+	unsigned h = 0;
+
+	for (; *name != 0; name++) {
+		h = h * 31 + (unsigned char)*name;
+	}
+	return h & (di->di_nbuckets - 1);
+}
+
+static
+void
+sfs_dirindex_destroy(struct sfs_vnode *sv)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+
+	if (di == NULL) {
+		return;
+	}
+	if (di->di_buckets != NULL) {
+		kfree(di->di_buckets);
+	}
+	if (di->di_next != NULL) {
+		kfree(di->di_next);
+	}
+	kfree(di);
+	sv->sv_dirindex = NULL;
+}
+
+/*
+ * Make room in di_next for NSLOTS slots.
+ */
+static
+int
+sfs_dirindex_reserve(struct sfs_dirindex *di, unsigned nslots)
+{
+	unsigned newmax;
+	int *newnext;
+
+	if (nslots <= di->di_maxslots) {
+		return 0;
+	}
+
+	newmax = di->di_maxslots > 0 ? di->di_maxslots : 1;
+	while (newmax < nslots) {
+		newmax *= 2;
+	}
+	newnext = kmalloc(newmax * sizeof(int));
+	if (newnext == NULL) {
+		return ENOMEM;
+	}
+	if (di->di_next != NULL) {
+		memcpy(newnext, di->di_next, di->di_nslots * sizeof(int));
+		kfree(di->di_next);
+	}
+	di->di_next = newnext;
+	di->di_maxslots = newmax;
+	return 0;
+}
+
 /*
- * Read the directory entry out of slot SLOT of a directory vnode.
- * The "slot" is the index of the directory entry, starting at 0.
+ * Scan the directory and build its index. On failure, just don't.
  */
 static
-int
-sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+void
+sfs_dirindex_build(struct sfs_vnode *sv)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
-
-	/* Compute the actual position in the directory to read. */
-	actualpos = slot * sizeof(struct sfs_dir);
+	struct sfs_dirindex *di;
+	struct sfs_dir tsd;
+	int nentries = sfs_dir_nentries(sv);
+	unsigned h;
+	int i;
 
-	/* Set up a uio to do the read */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_READ);
+	KASSERT(sv->sv_dirindex == NULL);
 
-	/* do it */
-	result = sfs_io(sv, &ku);
-	if (result) {
-		return result;
+	di = kmalloc(sizeof(struct sfs_dirindex));
+	if (di == NULL) {
+		return;
 	}
+	di->di_nbuckets = 16;
+	while (di->di_nbuckets < (unsigned)nentries) {
+		di->di_nbuckets *= 2;
+	}
+	di->di_buckets = kmalloc(di->di_nbuckets * sizeof(int));
+	di->di_next = NULL;
+	di->di_nslots = 0;
+	di->di_maxslots = 0;
+	di->di_free = -1;
+	sv->sv_dirindex = di;
 
-	/* We should not hit EOF in the middle of a directory entry */
-	if (ku.uio_resid > 0) {
-		panic("sfs: readdir: Short entry (inode %u)\n", sv->sv_ino);
+	if (di->di_buckets == NULL ||
+	    sfs_dirindex_reserve(di, nentries)) {
+		sfs_dirindex_destroy(sv);
+		return;
 	}
+	for (h=0; h<di->di_nbuckets; h++) {
+		di->di_buckets[h] = -1;
+	}
+	di->di_nslots = nentries;
 
-	/* Done */
-	return 0;
+	/* Backwards, so the free list comes out in slot order. */
+	for (i=nentries-1; i>=0; i--) {
+		if (sfs_readdir(sv, &tsd, i)) {
+			sfs_dirindex_destroy(sv);
+			return;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			di->di_next[i] = di->di_free;
+			di->di_free = i;
+		}
+		else {
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			h = sfs_dirindex_hash(di, tsd.sfd_name);
+			di->di_next[i] = di->di_buckets[h];
+			di->di_buckets[h] = i;
+		}
+	}
 }
 
 /*
- * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * Record that SLOT, which was empty or past the end, now holds NAME.
  */
 static
-int
-sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+void
+sfs_dirindex_add(struct sfs_vnode *sv, const char *name, int slot)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
-	int result;
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	unsigned h;
+	int *sp;
 
-	/* Compute the actual position in the directory. */
-	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_dir);
+	if (di == NULL) {
+		return;
+	}
 
-	/* Set up a uio to do the write */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+	if ((unsigned)slot >= di->di_nslots) {
+		/* Appended to the directory. */
+		KASSERT((unsigned)slot == di->di_nslots);
+		if (sfs_dirindex_reserve(di, slot + 1)) {
+			sfs_dirindex_destroy(sv);
+			return;
+		}
+		di->di_nslots = slot + 1;
+	}
+	else {
+		/* Take it off the free list. It's normally the first. */
+		for (sp = &di->di_free; *sp != slot; sp = &di->di_next[*sp]) {
+			KASSERT(*sp >= 0);
+		}
+		*sp = di->di_next[slot];
+	}
 
-	/* do it */
-	result = sfs_io(sv, &ku);
-	if (result) {
-		return result;
+	h = sfs_dirindex_hash(di, name);
+	di->di_next[slot] = di->di_buckets[h];
+	di->di_buckets[h] = slot;
+
+	if (di->di_nslots > 2 * di->di_nbuckets) {
+		/* The chains are getting long; start over with more. */
+		sfs_dirindex_destroy(sv);
+	}
+}
+
+/*
+ * Record that SLOT, which held NAME, is now empty.
+ */
+static
+void
+sfs_dirindex_remove(struct sfs_vnode *sv, const char *name, int slot)
+{
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	int *sp;
+
+	if (di == NULL) {
+		return;
 	}
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	for (sp = &di->di_buckets[sfs_dirindex_hash(di, name)]; *sp != slot;
+	     sp = &di->di_next[*sp]) {
+		KASSERT(*sp >= 0);
 	}
+	*sp = di->di_next[slot];
 
-	/* Done */
-	return 0;
+	di->di_next[slot] = di->di_free;
+	di->di_free = slot;
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * sfs_dir_findname for a directory with an index.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_dirindex_findname(struct sfs_vnode *sv, const char *name,
+		      uint32_t *ino, int *slot, int *emptyslot)
 {
-	off_t size;
+	struct sfs_dirindex *di = sv->sv_dirindex;
+	struct sfs_dir tsd;
+	int found = 0;
+	int i, result;
 
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	for (i = di->di_buckets[sfs_dirindex_hash(di, name)]; i >= 0;
+	     i = di->di_next[i]) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			return result;
+		}
+		KASSERT(tsd.sfd_ino != SFS_NOINO);
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (!strcmp(tsd.sfd_name, name)) {
+			KASSERT(found==0);
+
+			found = 1;
+			if (slot != NULL) {
+				*slot = i;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+		}
 	}
 
-	return size / sizeof(struct sfs_dir);
+	if (emptyslot != NULL && di->di_free >= 0) {
+		*emptyslot = di->di_free;
+	}
+
+	return found ? 0 : ENOENT;
 }
 
 /*
@@ -652,6 +1765,14 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
+	/* Big directories get an index, if they don't have one yet. */
+	if (sv->sv_dirindex == NULL && nentries >= SFS_DIRINDEX_MIN) {
+		sfs_dirindex_build(sv);
+	}
+	if (sv->sv_dirindex != NULL) {
+		return sfs_dirindex_findname(sv, name, ino, slot, emptyslot);
+	}
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -728,31 +1849,56 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		*slot = emptyslot;
 	}
 
+	/* The name cache may think the name doesn't exist. */
+	dcache_remove(&sv->sv_v, name);
+
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		/* Don't know what state the slot is in now. */
+		sfs_dirindex_destroy(sv);
+		return result;
+	}
+
+	sfs_dirindex_add(sv, sd.sfd_name, emptyslot);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME must be the
+ * name in that slot.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
+	/* Make the name cache forget it... */
+	dcache_remove(&sv->sv_v, name);
+
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		sfs_dirindex_destroy(sv);
+		return result;
+	}
+
+	sfs_dirindex_remove(sv, name, slot);
+	return 0;
 }
 
 /*
  * Look for a name in a directory and hand back a vnode for the
  * file, if there is one.
+ *
+ * Callers that don't need the slot get the answer from the name cache
+ * if it has one; otherwise what we find is recorded there.
  */
 static
 int
@@ -761,10 +1907,22 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		int *slot)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct vnode *v;
 	uint32_t ino;
 	int result;
 
+	if (slot == NULL && dcache_lookup(&sv->sv_v, name, &v)) {
+		if (v == NULL) {
+			return ENOENT;
+		}
+		*ret = v->vn_data;
+		return 0;
+	}
+
 	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	if (result == ENOENT) {
+		dcache_enter(&sv->sv_v, name, NULL);
+	}
 	if (result) {
 		return result;
 	}
@@ -779,6 +1937,8 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		      (*ret)->sv_ino, sv->sv_ino);
 	}
 
+	dcache_enter(&sv->sv_v, name, &(*ret)->sv_v);
+
 	return 0;
 }
 
@@ -791,17 +1951,19 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Put it
+	 * near its directory.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, dir->sv_ino, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,8 +2037,19 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Write the inode back to the buffer cache. It, and the
+	 * file's data, reach the disk at the next sync.
+	 */
+	lock_acquire(sv->sv_lock);
+	sfs_prealloc_release(sv);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,31 +2063,41 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Holding sfs_vnlock keeps sfs_loadvnode from handing the
+	 * vnode out again. Make sure nobody picked it up before we
+	 * got the lock.
 	 */
+	lock_acquire(sfs->sfs_vnlock);
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * Ours is the only reference, so nobody else can be holding
+	 * or waiting for sv_lock; this doesn't block.
+	 */
+	lock_acquire(sv->sv_lock);
+
+	sfs_prealloc_release(sv);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -922,7 +2105,8 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -932,25 +2116,14 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vnhash_remove(sfs, sv);
 
-	VOP_CLEANUP(&sv->sv_v);
+	lock_release(sv->sv_lock);
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	sfs_dirindex_destroy(sv);
+	lock_destroy(sv->sv_lock);
+	VOP_CLEANUP(&sv->sv_v);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -971,9 +2144,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +2163,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +2206,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1046,6 +2221,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type is set when the vnode is loaded and never changes, so
+ * this doesn't need the vnode's lock.
  */
 static
 int
@@ -1053,16 +2231,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,11 +2274,19 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result == 0) {
+		/*
+		 * We don't keep track of which buffers belong to
+		 * which file, so write out everything.
+		 */
+		result = buf_sync(sfs->sfs_device);
+	}
 
 	return result;
 }
@@ -1121,35 +2303,116 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard blocks BLOCKLEN and up of a file from the tree of indirect
+ * blocks whose top block is *BLOCKP. The tree is LEVELS levels deep
+ * and holds the file's blocks BASE through BASE+SPAN-1. If nothing
+ * is left in it, free the top block too and set *BLOCKP to 0; the
+ * caller marks whatever holds *BLOCKP dirty if it changes.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_tree(struct sfs_vnode *sv, uint32_t *blockp, unsigned levels,
+		  uint32_t base, uint32_t span, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idbuf;
+	uint32_t *iddata;
+	uint32_t j, child, childspan;
+	bool hasnonzero, iddirty;
+	int result;
 
-	struct sfs_vnode *sv = v->vn_data;
+	if (*blockp == 0 || base + span <= blocklen) {
+		/* No tree, or it's all before the new EOF */
+		return 0;
+	}
+
+	/* Read the top block */
+	result = buf_read(sfs->sfs_device, *blockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	iddata = buf_map(idbuf);
+
+	childspan = span / SFS_DBPERIDB;
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		child = iddata[j];
+		if (levels > 1) {
+			/* Trim the tree below this entry */
+			result = sfs_truncate_tree(sv, &iddata[j], levels - 1,
+						   base + j * childspan,
+						   childspan, blocklen);
+			if (result) {
+				if (iddata[j] != child) {
+					buf_markdirty(idbuf);
+				}
+				buf_release(idbuf);
+				return result;
+			}
+		}
+		else if (base + j >= blocklen && child != 0) {
+			/* Discard data blocks that are past the new EOF */
+			sfs_bfree(sfs, child);
+			iddata[j] = 0;
+		}
+		if (iddata[j] != child) {
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (iddata[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (iddirty) {
+		buf_markdirty(idbuf);
+	}
+	buf_release(idbuf);
+
+	if (!hasnonzero) {
+		/* The whole block is empty now; free it */
+		sfs_bfree(sfs, *blockp);
+		*blockp = 0;
+	}
+	return 0;
+}
+
+/*
+ * Truncate (or extend) a file to LEN bytes. The caller holds the
+ * vnode's lock.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	/* The trees of indirect blocks, from the inode */
+	uint32_t *roots[3] = {
+		&sv->sv_i.sfi_indirect,
+		&sv->sv_i.sfi_dindirect,
+		&sv->sv_i.sfi_tindirect,
+	};
+
+	uint32_t i, block, oldroot;
+	uint32_t base, span;
 	int result;
-	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sfs_prealloc_release(sv);
 
-	vfs_biglock_acquire();
+	if (sfs_isext(sfs)) {
+		result = sfs_ext_truncate(sv, blocklen);
+		if (result) {
+			return result;
+		}
+		goto done;
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,66 +2427,54 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
+	/*
+	 * Then the indirect, doubly indirect and triply indirect
+	 * blocks, which each hold SFS_DBPERIDB times as many blocks
+	 * as the one before.
+	 */
+	base = SFS_NDIRECT;
+	span = SFS_DBPERIDB;
+	for (i=0; i<3; i++) {
+		oldroot = *roots[i];
+		result = sfs_truncate_tree(sv, roots[i], i + 1, base, span,
+					   blocklen);
+		if (*roots[i] != oldroot) {
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
+		if (result) {
+			return result;
 		}
+		base += span;
+		span *= SFS_DBPERIDB;
 	}
 
+ done:
 	/* Set the file size */
 	sv->sv_i.sfi_size = len;
 
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +2510,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2529,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2551,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +2584,30 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/*
+	 * Hard links to directories aren't allowed. (The only one is
+	 * the root, so this would also mean locking DIR twice.)
+	 */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EPERM;
+	}
+
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,28 +2623,30 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1401,15 +2666,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1430,11 +2695,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1443,32 +2710,36 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -1477,7 +2748,9 @@ sfs_rename(struct vnode *d1, const char *n1,
  * directory it's in as a vnode.
  *
  * Since we don't support subdirectories, this is very easy - 
- * return the root dir and copy the path.
+ * return the root dir and copy the path. Nothing in the vnode is
+ * looked at except its type, which doesn't change, so no locking
+ * is needed.
  */
 static
 int
@@ -1486,15 +2759,11 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2771,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2788,18 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
-
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1651,42 +2915,42 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vnhash_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,13 +2963,28 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* Directories get an index when they need one */
+	sv->sv_dirindex = NULL;
+
+	/* Nothing reserved yet */
+	sv->sv_pastart = 0;
+	sv->sv_pacount = 0;
+	sv->sv_pawindow = SFS_PREALLOC;
+
+	/* No reads yet either */
+	sv->sv_ranext = 0;
+	sv->sv_rapos = 0;
+	sv->sv_rawindow = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,7 +3015,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,12 +3025,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vnhash_insert(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +3045,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
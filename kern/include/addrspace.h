@@ -36,8 +36,12 @@
 
 
 #include <vm.h>
+#include "opt-dumbvm.h"
 
 struct vnode;
+#if !OPT_DUMBVM
+struct pagetable;
+#endif
 
 
 /* 
@@ -47,7 +51,31 @@ struct vnode;
  * You write this.
  */
 
+#if !OPT_DUMBVM
+/* Number of pages reserved for the user stack */
+#define VM_STACKPAGES    256
+
+/* text, rodata, data/bss and the stack */
+#define AS_MAXREGIONS    4
+
+/*
+ * A contiguous range of valid virtual pages. Frames are allocated
+ * as the pages are first touched. If the region comes from the
+ * executable, file bytes [rg_fileoff, rg_fileoff+rg_filesize) of
+ * as_file belong at rg_filevaddr; everything else reads as zero.
+ */
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  bool rg_writeable;
+  vaddr_t rg_filevaddr;
+  off_t rg_fileoff;
+  size_t rg_filesize;
+};
+#endif
+
 struct addrspace {
+#if OPT_DUMBVM
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
   size_t as_npages1;
@@ -55,6 +83,12 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+#else
+  struct region as_regions[AS_MAXREGIONS];
+  unsigned as_nregions;
+  struct pagetable *as_pt;       /* virtual page -> frame */
+  struct vnode *as_file;         /* executable, for demand loading */
+#endif
 };
 
 /*
@@ -108,6 +142,36 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+/*
+ * as_findregion - return the region containing VADDR, or NULL if the
+ *                 address is not part of the address space.
+ *
+ * as_define_file - arrange for FILESIZE bytes of V starting at OFFSET
+ *                 to be paged in at VADDR on demand. VADDR must lie in
+ *                 a region already set up with as_define_region.
+ *
+ * as_loadpage   - fill the zeroed frame at PADDR with the contents of
+ *                 page VADDR of region RG, reading from the executable
+ *                 if any of the page is file-backed.
+ *
+ * as_evictpage  - take page VADDR, which is resident in the frame at
+ *                 PADDR, out of memory: write it to swap (or, if it can
+ *                 be reread from the executable, just forget it) and
+ *                 remove its translations. The frame must be pinned
+ *                 and mapped by this page alone; on success the caller
+ *                 is left to free it.
+ */
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_define_file(struct addrspace *as, struct vnode *v,
+                                 off_t offset, vaddr_t vaddr,
+                                 size_t filesize);
+int               as_loadpage(struct addrspace *as, struct region *rg,
+                              vaddr_t vaddr, paddr_t paddr);
+int               as_evictpage(struct addrspace *as, vaddr_t vaddr,
+                               paddr_t paddr);
+#endif
+
 
 /*
  * Functions in loadelf.c
@@ -38,6 +38,9 @@
  *                      Returns NULL on error.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *     bitmap_alloc_near - like bitmap_alloc, but take the first cleared
+ *                      bit at or after a given index, wrapping around
+ *                      to the start if there is none.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
  *     bitmap_isset   - return whether a particular bit is set or not.
@@ -50,6 +53,8 @@ struct bitmap;  /* Opaque. */
 struct bitmap *bitmap_create(unsigned nbits);
 void          *bitmap_getdata(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, unsigned *index);
+int            bitmap_alloc_near(struct bitmap *, unsigned goal,
+                                 unsigned *index);
 void           bitmap_mark(struct bitmap *, unsigned index);
 void           bitmap_unmark(struct bitmap *, unsigned index);
 int            bitmap_isset(struct bitmap *, unsigned index);
@@ -0,0 +1,88 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Caches disk blocks in memory, keyed by device and block number, so
+ * that filesystems don't go to the disk every time they look at the
+ * same inode, indirect block or directory block. Blocks are written
+ * back lazily: a modified buffer is written by a background thread
+ * once it has been dirty for a while (or sooner, if too many are
+ * dirty), when it is chosen for eviction, or when the cache is
+ * synced. Until then, further changes to it cost no disk I/O.
+ *
+ * A buffer handed out by buf_read or buf_get belongs to the caller
+ * until buf_release; anyone else asking for the same block waits.
+ * Don't ask for a block you already hold.
+ *
+ * All blocks are BUF_BLOCKSIZE bytes, which must be the device's
+ * sector size.
+ */
+
+#define BUF_BLOCKSIZE  512
+
+/* Most blocks buf_readrun gets at once. */
+#define BUF_MAXRUN     16
+
+struct buf;      /* Opaque. */
+struct device;   /* in <device.h> */
+
+/*
+ * buf_bootstrap  - set up the cache. Called once from vfs_bootstrap.
+ *
+ * buf_read       - get block BLOCK of DEV, reading it from disk if
+ *                  it isn't cached.
+ *
+ * buf_get        - get block BLOCK of DEV without reading it, for
+ *                  a caller that is going to overwrite all of it. If
+ *                  it wasn't cached, the contents are zeroed.
+ *
+ * buf_readrun    - get up to N (at most BUF_MAXRUN) consecutive blocks
+ *                  of DEV starting at BLOCK, like buf_read, into
+ *                  BUFS. The ones that aren't cached are read from
+ *                  disk together, as one transfer if the device can
+ *                  merge them. May stop short rather than wait for a
+ *                  block after the first; *GOT says how many it got,
+ *                  always at least 1 on success.
+ *
+ * buf_map        - return a pointer to the contents of a buffer.
+ *
+ * buf_readahead  - start reading block BLOCK of DEV into the cache in
+ *                  the background, for a caller that expects to want
+ *                  it soon. This is only a hint and may be ignored.
+ *
+ * buf_markdirty  - record that the caller has changed the contents,
+ *                  so the buffer is written back before it is reused.
+ *
+ * buf_release    - give a buffer back to the cache.
+ *
+ * buf_sync       - write every modified buffer of DEV to disk, waiting
+ *                  for any that are busy. The caller must not have any
+ *                  of DEV's buffers itself.
+ *
+ * buf_setsyncinterval - set how many seconds a modified buffer may
+ *                  wait before the background thread writes it. 0
+ *                  means only when buffers run short.
+ *
+ * buf_invalidate - discard every buffer of DEV, once nobody has any of
+ *                  them busy. Nothing new may be read or modified on
+ *                  DEV meanwhile. Anything still modified is written
+ *                  first; if that fails, the buffers that remain are
+ *                  kept and the error is returned. Used when
+ *                  unmounting.
+ */
+void buf_bootstrap(void);
+int buf_read(struct device *dev, uint32_t block, struct buf **ret);
+int buf_get(struct device *dev, uint32_t block, struct buf **ret);
+int buf_readrun(struct device *dev, uint32_t block, unsigned n,
+		struct buf **bufs, unsigned *got);
+void *buf_map(struct buf *b);
+void buf_readahead(struct device *dev, uint32_t block);
+void buf_markdirty(struct buf *b);
+void buf_release(struct buf *b);
+int buf_sync(struct device *dev);
+void buf_setsyncinterval(unsigned seconds);
+int buf_invalidate(struct device *dev);
+
+#endif /* _BUF_H_ */
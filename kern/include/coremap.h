@@ -0,0 +1,90 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical frame table (coremap).
+ *
+ * One entry per physical page of RAM that was still free when the VM
+ * system bootstrapped. Kernel allocations (alloc_kpages) take
+ * contiguous runs; user pages are handed out one frame at a time and
+ * need not be contiguous.
+ *
+ * Before coremap_bootstrap() is called, page allocation falls back to
+ * ram_stealmem(), and pages obtained that way are never reclaimed.
+ *
+ * When memory runs short, user pages are evicted to swap (see swap.h)
+ * by a clock algorithm: a hand sweeps the coremap, skipping frames
+ * used since it last passed and taking the first one that wasn't.
+ * A paging daemon keeps a few frames free in the background; if it
+ * falls behind, allocations evict synchronously.
+ *
+ * A user frame can be pinned, which keeps it from being chosen for
+ * eviction and makes anyone else trying to pin it wait. Frames are
+ * pinned while their contents are being filled in, while they are
+ * being written out, and while a translation for them is being
+ * loaded into the TLB.
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+/*
+ * coremap_bootstrap   - take over the remaining physical memory from
+ *                       ram.c. Called once from vm_bootstrap.
+ *
+ * coremap_startdaemon - start the paging daemon. Called once swap is
+ *                       available.
+ *
+ * coremap_alloc       - allocate NPAGES physically contiguous frames
+ *                       for kernel use. Returns 0 if none available.
+ *
+ * coremap_alloc_upage - allocate one zero-filled frame to hold page
+ *                       VADDR of address space AS. The frame is
+ *                       returned pinned. Returns 0 if none available.
+ *
+ * coremap_free        - release an allocation made by either of the
+ *                       above, given the physical address of its first
+ *                       frame. For a shared user frame this only drops
+ *                       one reference. User frames must be pinned by
+ *                       the caller; the pin is released either way.
+ *
+ * coremap_pin         - pin a user frame, waiting if it is already
+ *                       pinned. Returns false if by then the frame is
+ *                       free.
+ *
+ * coremap_unpin       - release a pin. This also marks the frame as
+ *                       recently used.
+ *
+ * coremap_setowner    - record that the pinned frame PADDR is now
+ *                       mapped only by page VADDR of AS.
+ *
+ * coremap_adopt       - like coremap_setowner, for a frame that may
+ *                       still be shared: if AS turns out to be its only
+ *                       mapping and the coremap had lost track of
+ *                       that, record it. Otherwise does nothing.
+ *
+ * coremap_incref      - add a reference to a pinned user frame that is
+ *                       about to be shared copy-on-write by AS, at
+ *                       the same address as its current mapping.
+ *
+ * coremap_release     - drop AS's reference to a pinned user frame,
+ *                       like coremap_free, but letting the coremap
+ *                       work out who still maps it.
+ *
+ * coremap_refcount    - current number of references to a user frame.
+ */
+void coremap_bootstrap(void);
+void coremap_startdaemon(void);
+paddr_t coremap_alloc(unsigned long npages);
+paddr_t coremap_alloc_upage(struct addrspace *as, vaddr_t vaddr);
+void coremap_free(paddr_t paddr);
+bool coremap_pin(paddr_t paddr);
+void coremap_unpin(paddr_t paddr);
+void coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_adopt(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_incref(paddr_t paddr, struct addrspace *as);
+void coremap_release(paddr_t paddr, struct addrspace *as);
+unsigned coremap_refcount(paddr_t paddr);
+
+#endif /* _COREMAP_H_ */
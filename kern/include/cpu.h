@@ -35,6 +35,12 @@
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
+/*
+ * Number of scheduling priority levels, and so of run queues per cpu.
+ * Level 0 runs first. See schedule() in thread.c.
+ */
+#define SCHED_NLEVELS 4
+
 
 /*
  * Per-cpu structure
@@ -66,7 +72,7 @@ struct cpu {
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues, by priority */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -152,6 +158,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends a TLB shootdown to all CPUs except
+ * the current one, and returns how many were sent.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +174,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
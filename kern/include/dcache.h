@@ -0,0 +1,56 @@
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+/*
+ * Directory name cache.
+ *
+ * Remembers the results of looking names up in directories, so that
+ * a filesystem doesn't have to search the directory again the next
+ * time the same name is looked up. A name that was found to not exist
+ * is remembered too (a "negative" entry).
+ *
+ * Filesystems use it from their lookup routines: they ask the cache
+ * first, and record what they found on a miss. They must remove the
+ * entry for a name whenever they add or remove that name in the
+ * directory. Filesystems whose directories can change behind their
+ * back (emufs) shouldn't use it.
+ *
+ * An entry holds a reference to the directory and to the vnode it
+ * names, so neither can be reclaimed while it is cached. The cache
+ * has a fixed number of entries and reuses the least recently used
+ * one when it is full. Names of DCACHE_NAMELEN bytes or more aren't
+ * cached.
+ *
+ * The cache has its own lock, which comes after any filesystem lock.
+ * It never calls into a filesystem while holding it.
+ */
+
+#define DCACHE_NAMELEN  32
+
+struct fs;
+struct vnode;
+
+/*
+ * dcache_bootstrap - set up the cache. Called once from vfs_bootstrap.
+ *
+ * dcache_lookup    - look up NAME in directory DIR. Returns true if
+ *                    the answer was cached, in which case *RET is the
+ *                    vnode (with a reference added for the caller) or
+ *                    NULL if the name doesn't exist.
+ *
+ * dcache_enter     - record that NAME in DIR is VN, or doesn't exist if
+ *                    VN is NULL.
+ *
+ * dcache_remove    - forget what NAME in DIR is.
+ *
+ * dcache_purgefs   - forget everything about filesystem FS, releasing
+ *                    the references the cache holds. Used when
+ *                    unmounting.
+ */
+void dcache_bootstrap(void);
+bool dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret);
+void dcache_enter(struct vnode *dir, const char *name, struct vnode *vn);
+void dcache_remove(struct vnode *dir, const char *name);
+void dcache_purgefs(struct fs *fs);
+
+#endif /* _DCACHE_H_ */
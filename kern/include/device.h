@@ -37,15 +37,48 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * Asynchronous block I/O request, for devices that have d_submit.
+ *
+ * The caller fills in the fields down to dr_arg and submits the
+ * request; the data must be in kernel memory. When the transfer is
+ * over the driver sets dr_result and dr_complete and then calls
+ * dr_callback, if there is one, possibly from its interrupt handler.
+ * If dr_callback is NULL the caller waits with d_wait instead.
+ */
+struct devreq {
+	uint32_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* number of blocks */
+	void *dr_data;			/* dr_nblocks * d_blocksize bytes */
+	bool dr_write;			/* true to write, false to read */
+	void (*dr_callback)(struct devreq *);
+	void *dr_arg;			/* for the caller's use */
+
+	/* Filled in by the driver */
+	volatile bool dr_complete;	/* set when finished */
+	int dr_result;			/* error code, or 0 */
+	struct devreq *dr_next;		/* for the driver's queue */
+	struct devreq *dr_merged;	/* for its scheduler, if any */
+	unsigned dr_deadline;		/* (see <disksched.h>) */
+	unsigned dr_seq;		/* (see <disksched.h>) */
+};
+
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ *
+ * Block devices may also take requests asynchronously: d_submit
+ * queues a request and returns at once, and d_wait sleeps until a
+ * request submitted without a callback is complete. These are NULL
+ * for devices that only do synchronous I/O.
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
+	int (*d_submit)(struct device *, struct devreq *);
+	void (*d_wait)(struct device *, struct devreq *);
 
 	blkcnt_t d_blocks;
 	blksize_t d_blocksize;
@@ -58,6 +91,9 @@ struct device {
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
+/* Get the device a vnode is for, or NULL if it isn't a device vnode. */
+struct device *dev_getdevice(struct vnode *v);
+
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
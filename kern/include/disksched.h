@@ -0,0 +1,65 @@
+#ifndef _DISKSCHED_H_
+#define _DISKSCHED_H_
+
+/*
+ * Disk request scheduling.
+ *
+ * A disk scheduler holds the requests (struct devreq) a driver has
+ * accepted but not yet started, and decides which goes next. How it
+ * orders them depends on the policy it was created with:
+ *
+ *    disksched_fifo   - arrival order.
+ *    disksched_cscan  - C-SCAN: sweep upward from where the last
+ *                       request ended, then go back to the lowest
+ *                       pending block and sweep upward again.
+ *
+ * Whatever the policy, a request still pending DISKSCHED_DEADLINE
+ * dispatches after it arrived goes next, so a busy region of the
+ * disk can't starve the rest.
+ *
+ * A request for blocks that carry on directly from a pending one in
+ * the same direction is merged with it. disksched_next returns the
+ * merged requests as a chain in block order, linked through
+ * dr_merged, which the driver should run back to back; each request
+ * in the chain still completes individually.
+ *
+ * Requests that overlap (share any block) run in the order they
+ * arrived, whatever the policy or deadlines say; a request that
+ * overlaps a pending one is never merged.
+ *
+ * The scheduler does no locking of its own. The driver calls it with
+ * whatever lock protects its queue held.
+ */
+
+struct devreq;     /* in <device.h> */
+struct disksched;  /* Opaque. */
+struct disksched_policy;  /* Opaque. */
+
+extern const struct disksched_policy disksched_fifo;
+extern const struct disksched_policy disksched_cscan;
+
+/* Longest a request can wait, counted in dispatches. */
+#define DISKSCHED_DEADLINE  32
+
+/* Most blocks merged into one chain. */
+#define DISKSCHED_MAXMERGE  64
+
+/*
+ * disksched_create     - make a scheduler for the device called NAME
+ *                        (used only in statistics output). Schedulers
+ *                        are never destroyed.
+ *
+ * disksched_add        - queue a request.
+ *
+ * disksched_next       - remove and return the next chain of requests
+ *                        to run, or NULL if nothing is pending.
+ *
+ * disksched_printstats - print the statistics for every scheduler.
+ */
+struct disksched *disksched_create(const char *name,
+				   const struct disksched_policy *policy);
+void disksched_add(struct disksched *ds, struct devreq *req);
+struct devreq *disksched_next(struct disksched *ds);
+void disksched_printstats(void);
+
+#endif /* _DISKSCHED_H_ */
@@ -71,21 +71,75 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_flags;			/* SFS_FEAT_* below */
+	uint32_t reserved[117];
 };
 
+/*
+ * Flags for sp_flags, chosen when the volume is made.
+ *
+ * SFS_FEAT_EXTENTS: inodes map their blocks with extents (see
+ * struct sfs_inode) instead of direct and indirect blocks.
+ */
+#define SFS_FEAT_EXTENTS  0x00000001
+#define SFS_FEAT_ALL      (SFS_FEAT_EXTENTS)
+
+/*
+ * On-disk extent: LEN blocks of a file, stored at blocks START
+ * through START+LEN-1, or not allocated at all (a hole) if START is
+ * 0. An extent with LEN 0 is unused.
+ */
+struct sfs_extent {
+	uint32_t sfe_start;			/* First block, or 0 */
+	uint32_t sfe_len;			/* Number of blocks */
+};
+
+/* Number of extents in an inode, and in an extent block */
+#define SFS_NEXTENTS      62
+#define SFS_XEXTENTS      (SFS_BLOCKSIZE/sizeof(struct sfs_extent))
+
 /*
  * On-disk inode
+ *
+ * After the direct blocks, a file's blocks are found through the
+ * indirect block (SFS_DBPERIDB blocks), then the doubly indirect
+ * block (SFS_DBPERIDB indirect blocks), then the triply indirect
+ * block (SFS_DBPERIDB doubly indirect blocks). The doubly and triply
+ * indirect pointers used to be part of sfi_waste, so on older
+ * volumes they are 0, which means the same as on newer ones: no
+ * block.
+ *
+ * On a volume with SFS_FEAT_EXTENTS, the same space holds extents
+ * instead. The used ones come first, and cover the file's blocks in
+ * order from block 0. Adjacent extents are always merged. If a file
+ * has more runs of contiguous blocks and holes than fit in the inode,
+ * the rest carry on in its extent block, sfi_extblock, so it can have
+ * at most SFS_NEXTENTS+SFS_XEXTENTS of them.
  */
 struct sfs_inode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
 	uint16_t sfi_type;			/* One of SFS_TYPE_* above */
 	uint16_t sfi_linkcount;			/* # hard links to this file */
-	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
-	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	union {
+		struct {
+			uint32_t sfi_direct[SFS_NDIRECT]; /* Direct blocks */
+			uint32_t sfi_indirect;	  /* Indirect block */
+			uint32_t sfi_dindirect;	  /* Doubly indirect block */
+			uint32_t sfi_tindirect;	  /* Triply indirect block */
+			uint32_t sfi_waste[128-5-SFS_NDIRECT]; /* set to 0 */
+		};
+		struct {
+			struct sfs_extent sfi_extents[SFS_NEXTENTS];
+			uint32_t sfi_extblock;	  /* More extents, or 0 */
+			uint32_t sfi_extwaste;	  /* set to 0 */
+		};
+	};
 };
 
+/* Tell tools (sfsck) which of the above the inode has. */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /*
  * On-disk directory entry
  */
@@ -0,0 +1,70 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-address-space page tables.
+ *
+ * A two-level table indexed by virtual page number: the top 10 bits
+ * of the address select a second-level table, the next 10 bits select
+ * the entry within it. Second-level tables are one page each and are
+ * only allocated when something in their 4M range is mapped, so a
+ * typical process with text, data and stack needs three of them.
+ *
+ * Only the user half of the address space (below USERSPACETOP) is
+ * ever mapped through here.
+ *
+ * A page that has been evicted keeps its entry with PTE_VALID clear
+ * and PTE_SWAPPED set; the frame bits then hold its swap slot.
+ */
+
+#include <vm.h>
+
+typedef uint32_t pte_t;
+
+/* Fields in a page table entry. The frame occupies the PAGE_FRAME bits. */
+#define PTE_VALID     0x00000001    /* frame below is resident */
+#define PTE_COW       0x00000002    /* frame is shared; copy before writing */
+#define PTE_SWAPPED   0x00000004    /* not resident; contents are in swap */
+
+#define PTE_FRAME(pte)       ((paddr_t)((pte) & PAGE_FRAME))
+#define PTE_MAKE(pa, flags)  (((pa) & PAGE_FRAME) | (flags))
+
+#define PTE_SWAPSLOT(pte)    ((unsigned)((pte) >> 12))
+#define PTE_MAKESWAP(slot)   (((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+#define PT_NENTRIES   (PAGE_SIZE / sizeof(pte_t))     /* per 2nd-level table */
+#define PT_NDIRS      (USERSPACETOP >> 22)            /* 1st-level slots */
+
+#define PT_DIRINDEX(va)   ((va) >> 22)
+#define PT_INDEX(va)      (((va) >> 12) & (PT_NENTRIES - 1))
+#define PT_VADDR(d, i)    ((vaddr_t)(((d) << 22) | ((i) << 12)))
+
+struct pagetable {
+	pte_t *pt_dir[PT_NDIRS];
+};
+
+/*
+ * pt_create  - allocate an empty page table. Returns NULL if out of
+ *              memory.
+ *
+ * pt_destroy - free a page table and all of its second-level tables.
+ *              Does not touch the frames the entries point to; the
+ *              caller is expected to have released those.
+ *
+ * pt_lookup  - return a pointer to the entry for VADDR. If no
+ *              second-level table covers VADDR and CREATE is false,
+ *              returns NULL; if CREATE is true one is allocated (and
+ *              NULL means out of memory).
+ *
+ * pt_pin     - pin the frame mapped by *PTE so the page can't be
+ *              evicted out from under the caller, waiting for any
+ *              eviction already in progress. Returns false, with
+ *              nothing pinned, if the page is not resident (any more).
+ *              Release with coremap_unpin().
+ */
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+bool pt_pin(pte_t *pte);
+
+#endif /* _PAGETABLE_H_ */
@@ -41,15 +41,23 @@
 
 struct addrspace;
 struct vnode;
+struct cv;
 #ifdef UW
 struct semaphore;
 #endif // UW
 
+/*
+ * PIDs handed out are in [PID_MIN, PROC_MAXPID). The process table is
+ * indexed by PID, so this is kept well below PID_MAX.
+ */
+#define PROC_MAXPID  4096
+
 /*
  * Process structure.
  */
 struct proc {
 	char *p_name;			/* Name of this process */
+	pid_t p_pid;			/* Process ID */
 	struct spinlock p_lock;		/* Lock for this structure */
 	struct threadarray p_threads;	/* Threads in this process */
 
@@ -59,6 +67,19 @@ struct proc {
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
 
+	/*
+	 * Family and exit status; protected by the process table lock,
+	 * not p_lock. A child is on its parent's p_children list until
+	 * the parent collects it with waitpid or exits itself.
+	 */
+	struct proc *p_parent;		/* NULL if nobody will wait for us */
+	struct proc *p_children;	/* first child */
+	struct proc *p_sibnext;		/* next child of p_parent */
+	struct proc *p_sibprev;		/* previous child of p_parent */
+	bool p_exited;			/* true once we are a zombie */
+	int p_exitstatus;		/* encoded as in <kern/wait.h> */
+	struct cv *p_exitcv;		/* signalled when we exit */
+
 #ifdef UW
   /* a vnode to refer to the console device */
   /* this is a quick-and-dirty way to get console writes working */
@@ -82,12 +103,32 @@ extern struct semaphore *no_proc_sem;
 /* Call once during system startup to allocate data structures. */
 void proc_bootstrap(void);
 
-/* Create a fresh process for use by runprogram(). */
+/*
+ * Create a fresh process for use by runprogram(). It gets a PID, and
+ * if the current process is a user process, becomes its child.
+ */
 struct proc *proc_create_runprogram(const char *name);
 
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
+/*
+ * Finish exiting: called by a process's last thread once it has
+ * detached itself. Hands EXITSTATUS to the parent, if there is one to
+ * collect it, and otherwise destroys the process. Children still
+ * running are orphaned; children already exited are destroyed.
+ */
+void proc_exit(struct proc *proc, int exitstatus);
+
+/*
+ * Wait for child PID of the current process to exit and hand it back
+ * in *RET, still a zombie, so its status can be reported before
+ * proc_reap destroys it. Fails with ESRCH if there is no such process
+ * and ECHILD if it isn't our child.
+ */
+int proc_waitchild(pid_t pid, struct proc **ret);
+void proc_reap(struct proc *child);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -48,11 +48,39 @@
  */
 #include <kern/sfs.h>
 
+struct sfs_dirindex;  /* in sfs_vnode.c */
+
+/*
+ * Locking: sv_lock protects a file's inode and contents, and
+ * everything else in its sfs_vnode except sv_v and sv_ino, which
+ * don't change, and sv_hashnext, which belongs to the vnode table.
+ * sfs_vnlock protects the table of loaded vnodes, and
+ * sfs_freemaplock the free block bitmap and the superblock.
+ *
+ * The order is: a directory's sv_lock, then sfs_vnlock, then a file's
+ * sv_lock, then sfs_freemaplock.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
+	struct lock *sv_lock;           /* lock for the rest */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* next in sfs_vnhash chain */
+
+	/* Sequential read detection; see sfs_readahead */
+	uint32_t sv_ranext;             /* block a sequential read starts at */
+	uint32_t sv_rapos;              /* first block not read ahead yet */
+	unsigned sv_rawindow;           /* blocks to read ahead, 0 if random */
+
+	/* Directories only; see sfs_dirindex_build */
+	struct sfs_dirindex *sv_dirindex;
+
+	/* Blocks reserved for the file to grow into; see sfs_fballoc */
+	uint32_t sv_pastart;            /* first reserved block */
+	unsigned sv_pacount;            /* number of reserved blocks */
+	unsigned sv_pawindow;           /* blocks to reserve next time */
 };
 
 struct sfs_fs {
@@ -60,11 +88,32 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded into memory */
+	unsigned sfs_vnhashsize;        /* number of chains in sfs_vnhash */
+	unsigned sfs_nvnodes;           /* number of vnodes in sfs_vnhash */
+	struct lock *sfs_freemaplock;   /* lock for the freemap and super */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
 
+/*
+ * The vnode table is a hash table keyed on inode number, with
+ * sfs_vnhashsize chains (always a power of 2). It starts with
+ * SFS_VNHASH_MINSIZE chains and doubles whenever there are more than
+ * SFS_VNHASH_LOAD vnodes per chain on average.
+ */
+#define SFS_VNHASH_MINSIZE  64
+#define SFS_VNHASH_LOAD     2
+
+/*
+ * Blocks reserved at once for a file being written: SFS_PREALLOC at
+ * first, doubling up to SFS_PREALLOCMAX while it's written in order.
+ * See sfs_fballoc.
+ */
+#define SFS_PREALLOC     16
+#define SFS_PREALLOCMAX  256
+
 /*
  * Function for mounting a sfs (calls vfs_mount)
  */
@@ -75,17 +124,15 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
-/* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
-
-/* Convenience functions for block I/O */
-int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+/* Copy whole blocks through the buffer cache */
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Write a vnode's inode into the buffer cache, if it changed */
+int sfs_sync_inode(struct sfs_vnode *sv);
+
 
 #endif /* _SFS_H_ */
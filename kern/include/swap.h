@@ -0,0 +1,37 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * Evicted user pages are written to a raw disk, which is divided into
+ * page-sized slots. If the disk isn't there, the system runs without
+ * swap and only pages that can be reread from the executable are ever
+ * evicted.
+ */
+
+#include <vm.h>
+
+/* The whole of this device is used for swap. */
+#define SWAP_DEVICE "lhd0raw:"
+
+/*
+ * swap_bootstrap - open the swap device. Called once from vm_bootstrap.
+ *                  Returns false if there is no usable swap.
+ *
+ * swap_alloc     - reserve a free slot. Returns ENOSPC if swap is full
+ *                  (or absent).
+ *
+ * swap_free      - release a slot; its contents are discarded.
+ *
+ * swap_in        - read the page in SLOT into the frame at PADDR.
+ *
+ * swap_out       - write the frame at PADDR to SLOT.
+ */
+bool swap_bootstrap(void);
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int swap_in(unsigned slot, paddr_t paddr);
+int swap_out(paddr_t paddr, unsigned slot);
+
+#endif /* _SWAP_H_ */
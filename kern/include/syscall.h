@@ -50,6 +50,10 @@ void enter_forked_process(struct trapframe *tf);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+/* Load a program into the current process, ready for enter_new_process. */
+int loadprogram(char *progname, int argc, char **argv,
+		vaddr_t *entrypoint, vaddr_t *stackptr, userptr_t *uargv);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -61,8 +65,11 @@ int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
+void exit_curproc(int exitstatus);
+int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
+int sys_spawn(userptr_t prog, userptr_t args, pid_t *retval);
 
 #endif // UW
 
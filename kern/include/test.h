@@ -74,11 +74,13 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int bigwrite(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
 int nettest(int, char **);
 
 /* Tests for assignment problem functions */
@@ -84,6 +84,15 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduling fields. Protected by the run queue lock of
+	 * t_cpu, or owned by whoever took the thread off a wait
+	 * channel to wake it.
+	 */
+	unsigned t_priority;		/* Run queue level; 0 is highest */
+	unsigned t_sched_ticks;		/* Time charged at this level */
+	unsigned t_migrated;		/* t_cpu's c_hardclocks when moved there */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -163,7 +172,7 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
+ * Potentially take ready threads from other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
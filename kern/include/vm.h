@@ -59,5 +59,8 @@ void free_kpages(vaddr_t addr);
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Remove any translation for VADDR from every CPU's TLB */
+void vm_tlbshootdown_vaddr(vaddr_t vaddr);
+
 
 #endif /* _VM_H_ */
@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,8 +51,12 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * vn_countlock protects vn_refcount and vn_opencount. Everything else
+ * about the file is up to the filesystem to lock.
  */
 struct vnode {
+	struct spinlock vn_countlock;   /* Lock for the counts */
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
 
@@ -89,7 +94,10 @@ struct vnode {
  *
  *    vop_reclaim     - Called when vnode is no longer in use. Note that
  *                      this may be substantially after vop_close is
- *                      called.
+ *                      called. It is passed the last reference, and
+ *                      is called without any locks held, so someone
+ *                      may pick the vnode up again first; if so it
+ *                      should drop that reference and return EBUSY.
  *
  *****************************************
  *
@@ -120,6 +120,51 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, startix, n;
+        unsigned offset;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+
+        /* Bits in the goal's own word, from the goal up */
+        startix = goal / BITS_PER_WORD;
+        for (offset = goal % BITS_PER_WORD; offset < BITS_PER_WORD;
+             offset++) {
+                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                if ((b->v[startix] & mask)==0) {
+                        b->v[startix] |= mask;
+                        *index = (startix*BITS_PER_WORD)+offset;
+                        KASSERT(*index < b->nbits);
+                        return 0;
+                }
+        }
+
+        /* Then whole words, wrapping around back to the goal's word */
+        for (n=1; n<=maxix; n++) {
+                ix = (startix + n) % maxix;
+                if (b->v[ix]!=WORD_ALLBITS) {
+                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
+                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                                if ((b->v[ix] & mask)==0) {
+                                        b->v[ix] |= mask;
+                                        *index = (ix*BITS_PER_WORD)+offset;
+                                        KASSERT(*index < b->nbits);
+                                        return 0;
+                                }
+                        }
+                        KASSERT(0);
+                }
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -43,6 +43,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <bitmap.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -69,6 +72,21 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 
+/*
+ * The process table. proc_table[pid] is the process with that PID,
+ * and proc_pids has the bit for every PID in use set (as well as
+ * those below PID_MIN, which are never handed out), so finding a
+ * process by PID takes one lookup. New PIDs are searched for from
+ * just after the last one handed out, so that a PID isn't reused
+ * straight away.
+ *
+ * proc_tablelock protects the table and the family and exit fields
+ * of every process. It comes before p_lock.
+ */
+static struct lock *proc_tablelock;
+static struct proc **proc_table;
+static struct bitmap *proc_pids;
+static unsigned proc_pidnext;
 
 
 /*
@@ -90,6 +108,14 @@ proc_create(const char *name)
 		return NULL;
 	}
 
+	proc->p_exitcv = cv_create(name);
+	if (proc->p_exitcv == NULL) {
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+
+	proc->p_pid = 0;
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
 
@@ -99,6 +125,14 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
+	/* Family and exit fields */
+	proc->p_parent = NULL;
+	proc->p_children = NULL;
+	proc->p_sibnext = NULL;
+	proc->p_sibprev = NULL;
+	proc->p_exited = false;
+	proc->p_exitstatus = 0;
+
 #ifdef UW
 	proc->console = NULL;
 #endif // UW
@@ -106,6 +140,75 @@ proc_create(const char *name)
 	return proc;
 }
 
+/*
+ * Take PROC off its parent's list of children. Must hold
+ * proc_tablelock.
+ */
+static
+void
+proc_unlink(struct proc *proc)
+{
+	struct proc *parent = proc->p_parent;
+
+	KASSERT(lock_do_i_hold(proc_tablelock));
+
+	if (parent == NULL) {
+		return;
+	}
+	if (proc->p_sibprev != NULL) {
+		proc->p_sibprev->p_sibnext = proc->p_sibnext;
+	}
+	else {
+		KASSERT(parent->p_children == proc);
+		parent->p_children = proc->p_sibnext;
+	}
+	if (proc->p_sibnext != NULL) {
+		proc->p_sibnext->p_sibprev = proc->p_sibprev;
+	}
+	proc->p_sibnext = proc->p_sibprev = NULL;
+	proc->p_parent = NULL;
+}
+
+/*
+ * Give PROC a PID and put it in the process table. If the current
+ * process is a user process, PROC becomes its child.
+ */
+static
+int
+proc_register(struct proc *proc)
+{
+	struct proc *parent = curproc;
+	unsigned pid;
+	int result;
+
+	lock_acquire(proc_tablelock);
+
+	result = bitmap_alloc_near(proc_pids, proc_pidnext, &pid);
+	if (result) {
+		lock_release(proc_tablelock);
+		return ENPROC;
+	}
+	KASSERT(pid >= PID_MIN && pid < PROC_MAXPID);
+	proc_pidnext = pid + 1 < PROC_MAXPID ? pid + 1 : PID_MIN;
+
+	KASSERT(proc_table[pid] == NULL);
+	proc_table[pid] = proc;
+	proc->p_pid = pid;
+
+	if (parent != NULL && parent != kproc) {
+		proc->p_parent = parent;
+		proc->p_sibprev = NULL;
+		proc->p_sibnext = parent->p_children;
+		if (parent->p_children != NULL) {
+			parent->p_children->p_sibprev = proc;
+		}
+		parent->p_children = proc;
+	}
+
+	lock_release(proc_tablelock);
+	return 0;
+}
+
 /*
  * Destroy a proc structure.
  */
@@ -163,8 +266,20 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
+	/* Give up the PID. */
+	if (proc->p_pid != 0) {
+		lock_acquire(proc_tablelock);
+		proc_unlink(proc);
+		KASSERT(proc->p_children == NULL);
+		KASSERT(proc_table[proc->p_pid] == proc);
+		proc_table[proc->p_pid] = NULL;
+		bitmap_unmark(proc_pids, proc->p_pid);
+		lock_release(proc_tablelock);
+	}
+
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
+	cv_destroy(proc->p_exitcv);
 
 	kfree(proc->p_name);
 	kfree(proc);
@@ -193,6 +308,8 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+  unsigned i;
+
   kproc = proc_create("[kernel]");
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
@@ -208,6 +325,19 @@ proc_bootstrap(void)
     panic("could not create no_proc_sem semaphore\n");
   }
 #endif // UW 
+  proc_tablelock = lock_create("proc_table");
+  proc_table = kmalloc(PROC_MAXPID * sizeof(struct proc *));
+  proc_pids = bitmap_create(PROC_MAXPID);
+  if (proc_tablelock == NULL || proc_table == NULL || proc_pids == NULL) {
+    panic("could not create the process table\n");
+  }
+  for (i=0; i<PROC_MAXPID; i++) {
+    proc_table[i] = NULL;
+  }
+  for (i=0; i<PID_MIN; i++) {
+    bitmap_mark(proc_pids, i);
+  }
+  proc_pidnext = PID_MIN;
 }
 
 /*
@@ -271,9 +401,103 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+	if (proc_register(proc)) {
+		proc_destroy(proc);
+		return NULL;
+	}
+
 	return proc;
 }
 
+void
+proc_exit(struct proc *proc, int exitstatus)
+{
+	struct proc *child, *next, *zombies;
+	bool orphan;
+
+	KASSERT(proc != kproc);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
+
+	lock_acquire(proc_tablelock);
+
+	/*
+	 * Nobody can wait for our children any more. Those already
+	 * exited go, using p_sibnext to list them; the rest will clean
+	 * up after themselves when they exit.
+	 */
+	zombies = NULL;
+	for (child = proc->p_children; child != NULL; child = next) {
+		next = child->p_sibnext;
+		child->p_parent = NULL;
+		child->p_sibprev = NULL;
+		child->p_sibnext = NULL;
+		if (child->p_exited) {
+			child->p_sibnext = zombies;
+			zombies = child;
+		}
+	}
+	proc->p_children = NULL;
+
+	proc->p_exited = true;
+	proc->p_exitstatus = exitstatus;
+	orphan = proc->p_parent == NULL;
+	if (!orphan) {
+		cv_broadcast(proc->p_exitcv, proc_tablelock);
+	}
+
+	/* Once we let go, the parent may reap PROC at any moment. */
+	lock_release(proc_tablelock);
+
+	for (child = zombies; child != NULL; child = next) {
+		next = child->p_sibnext;
+		child->p_sibnext = NULL;
+		proc_destroy(child);
+	}
+	if (orphan) {
+		proc_destroy(proc);
+	}
+}
+
+int
+proc_waitchild(pid_t pid, struct proc **ret)
+{
+	struct proc *child;
+
+	if (pid < PID_MIN || pid >= PROC_MAXPID) {
+		return ESRCH;
+	}
+
+	lock_acquire(proc_tablelock);
+	child = proc_table[pid];
+	if (child == NULL) {
+		lock_release(proc_tablelock);
+		return ESRCH;
+	}
+	if (child->p_parent != curproc) {
+		lock_release(proc_tablelock);
+		return ECHILD;
+	}
+	while (!child->p_exited) {
+		cv_wait(child->p_exitcv, proc_tablelock);
+	}
+	lock_release(proc_tablelock);
+
+	/*
+	 * Only we can reap it, and we can't exit while in here, so it
+	 * stays put until proc_reap.
+	 */
+	*ret = child;
+	return 0;
+}
+
+void
+proc_reap(struct proc *child)
+{
+	KASSERT(child->p_exited);
+	KASSERT(child->p_parent == curproc);
+	proc_destroy(child);
+}
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
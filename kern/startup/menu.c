@@ -39,6 +39,8 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <buf.h>
+#include <disksched.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -259,6 +261,26 @@ cmd_sync(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for setting how long modified disk blocks are held in
+ * memory before being written back.
+ */
+static
+int
+cmd_syncinterval(int nargs, char **args)
+{
+	int seconds;
+
+	if (nargs != 2 || (seconds = atoi(args[1])) < 0) {
+		kprintf("Usage: syncint seconds\n");
+		return EINVAL;
+	}
+
+	buf_setsyncinterval(seconds);
+
+	return 0;
+}
+
 /*
  * Command for doing an intentional panic.
  */
@@ -409,6 +431,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	disksched_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -448,6 +482,7 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[syncint] Set write-back delay      ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
     "[dth]     Enable the output of debug messages of type DB_THREADS",
@@ -470,6 +505,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc benchmark             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -488,6 +524,7 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS big write          (4)     ",
 	NULL
 };
 
@@ -519,6 +556,7 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[ds] Disk scheduler stats           ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -559,6 +597,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "syncint",	cmd_syncinterval },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -576,12 +615,14 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ds",		cmd_diskstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -604,6 +645,7 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	bigwrite },
 	
 	/* Tests for assignment problem functions */
 	{ "wg1",    testwg },  // test for A1 traffic synchronization problem WaitGroups 
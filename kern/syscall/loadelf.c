@@ -43,7 +43,10 @@
  * need to do anything.
  *
  * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * to rearrange this to map each segment. (With the paged VM system,
+ * that is in effect what happens: load_segment only tells the address
+ * space where each segment lives in the file, and pages are read in
+ * on first touch.)
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -59,6 +62,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -81,9 +85,11 @@ load_segment(struct addrspace *as, struct vnode *v,
 	     size_t memsize, size_t filesize,
 	     int is_executable)
 {
+#if OPT_DUMBVM
 	struct iovec iov;
 	struct uio u;
 	int result;
+#endif
 
 	if (filesize > memsize) {
 		kprintf("ELF: warning: segment filesize > segment memsize\n");
@@ -93,6 +99,11 @@ load_segment(struct addrspace *as, struct vnode *v,
 	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n", 
 	      (unsigned long) filesize, (unsigned long) vaddr);
 
+#if !OPT_DUMBVM
+	/* Demand paging: just record where the segment comes from. */
+	(void)is_executable;
+	return as_define_file(as, v, offset, vaddr, filesize);
+#else
 	iov.iov_ubase = (userptr_t)vaddr;
 	iov.iov_len = memsize;		 // length of the memory space
 	u.uio_iov = &iov;
@@ -143,6 +154,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 #endif
 	
 	return result;
+#endif /* OPT_DUMBVM */
 }
 
 /*
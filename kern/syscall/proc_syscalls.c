@@ -2,28 +2,82 @@
 #include <kern/errno.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
+#include <limits.h>
 #include <lib.h>
+#include <synch.h>
 #include <syscall.h>
 #include <current.h>
 #include <proc.h>
 #include <thread.h>
 #include <addrspace.h>
 #include <copyinout.h>
+#include <mips/trapframe.h>
 
-  /* this implementation of sys__exit does not do anything with the exit code */
-  /* this needs to be fixed to get exit() and waitpid() working properly */
+/* thread_fork entry point for the child of a fork() */
+static void
+fork_child_start(void *data1, unsigned long data2)
+{
+  (void)data2;
+  enter_forked_process((struct trapframe *)data1);
+}
 
-void sys__exit(int exitcode) {
+/* handler for fork() system call                */
+/* the child shares the parent's pages copy-on-write (see as_copy) */
+int
+sys_fork(struct trapframe *tf, pid_t *retval)
+{
+  struct proc *child;
+  struct addrspace *as;
+  struct trapframe *childtf;
+  int result;
+
+  DEBUG(DB_SYSCALL,"Syscall: fork()\n");
+
+  child = proc_create_runprogram(curproc->p_name);
+  if (child == NULL) {
+    return ENOMEM;
+  }
 
+  result = as_copy(curproc_getas(), &as);
+  if (result) {
+    proc_destroy(child);
+    return result;
+  }
+  /* nobody else can see the child yet, so no need for p_lock */
+  child->p_addrspace = as;
+
+  /* the child's copy of the trapframe is freed by enter_forked_process */
+  childtf = kmalloc(sizeof(struct trapframe));
+  if (childtf == NULL) {
+    child->p_addrspace = NULL;
+    as_destroy(as);
+    proc_destroy(child);
+    return ENOMEM;
+  }
+  *childtf = *tf;
+
+  result = thread_fork(curthread->t_name, child, fork_child_start, childtf, 0);
+  if (result) {
+    kfree(childtf);
+    child->p_addrspace = NULL;
+    as_destroy(as);
+    proc_destroy(child);
+    return result;
+  }
+
+  *retval = child->p_pid;
+  return 0;
+}
+
+/* end the current process, leaving EXITSTATUS (encoded as in   */
+/* <kern/wait.h>) for its parent; used by _exit() and fatal traps */
+void
+exit_curproc(int exitstatus)
+{
   struct addrspace *as;
   struct proc *p = curproc;
-  /* for now, just include this to keep the compiler from complaining about
-     an unused variable */
-  (void)exitcode;
-
-  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
 
-  KASSERT(curproc->p_addrspace != NULL);
+  /* a spawned process that failed to load may have no address space */
   as_deactivate();
   /*
    * clear p_addrspace before calling as_destroy. Otherwise if
@@ -33,33 +87,40 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  if (as != NULL) {
+    as_destroy(as);
+  }
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
 
-  /* if this is the last user process in the system, proc_destroy()
-     will wake up the kernel menu thread */
-  proc_destroy(p);
+  /* hand the exit status to the parent, or if there is none, destroy
+     the process; if this is the last user process in the system,
+     proc_destroy() will wake up the kernel menu thread */
+  proc_exit(p, exitstatus);
   
   thread_exit();
   /* thread_exit() does not return, so we should never get here */
-  panic("return from thread_exit in sys_exit\n");
+  panic("return from thread_exit in exit_curproc\n");
+}
+
+void sys__exit(int exitcode) {
+  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+  exit_curproc(_MKWAIT_EXIT(exitcode));
 }
 
 
-/* stub handler for getpid() system call                */
+/* handler for getpid() system call                */
 int
 sys_getpid(pid_t *retval)
 {
-  /* for now, this is just a stub that always returns a PID of 1 */
-  /* you need to fix this to make it work properly */
-  *retval = 1;
+  *retval = curproc->p_pid;
   return(0);
 }
 
-/* stub handler for waitpid() system call                */
+/* handler for waitpid() system call                */
+/* only a process's parent may wait for it            */
 
 int
 sys_waitpid(pid_t pid,
@@ -67,28 +128,228 @@ sys_waitpid(pid_t pid,
 	    int options,
 	    pid_t *retval)
 {
+  struct proc *child;
   int exitstatus;
   int result;
 
-  /* this is just a stub implementation that always reports an
-     exit status of 0, regardless of the actual exit status of
-     the specified process.   
-     In fact, this will return 0 even if the specified process
-     is still running, and even if it never existed in the first place.
-
-     Fix this!
-  */
-
   if (options != 0) {
     return(EINVAL);
   }
-  /* for now, just pretend the exitstatus is 0 */
-  exitstatus = 0;
+
+  result = proc_waitchild(pid, &child);
+  if (result) {
+    return(result);
+  }
+
+  /* copy the status out before reaping the child, so that if the
+     pointer is bad the child is still there to wait for again */
+  exitstatus = child->p_exitstatus;
   result = copyout((void *)&exitstatus,status,sizeof(int));
   if (result) {
     return(result);
   }
+  proc_reap(child);
+
   *retval = pid;
   return(0);
 }
 
+/* kernel copy of spawn()'s program and arguments, lent to the child */
+/* until it has loaded the program and posted sa_loaded                 */
+struct spawnargs {
+  char *sa_progname;
+  int sa_argc;
+  char **sa_argv;
+  char *sa_argbuf;              /* holds the argument strings */
+  struct semaphore *sa_loaded;
+  int sa_result;                /* from loadprogram, for the parent */
+};
+
+static void
+spawnargs_cleanup(struct spawnargs *sa)
+{
+  kfree(sa->sa_progname);
+  kfree(sa->sa_argv);
+  kfree(sa->sa_argbuf);
+  if (sa->sa_loaded != NULL) {
+    sem_destroy(sa->sa_loaded);
+  }
+}
+
+/* first size of sa_argbuf; it doubles as needed, up to ARG_MAX */
+#define SPAWN_ARGBUF_MIN 256
+
+/* copy in the program name and the NULL-terminated argument vector */
+static int
+spawnargs_copyin(struct spawnargs *sa, userptr_t prog, userptr_t args)
+{
+  userptr_t uarg;
+  size_t space, size, used, got;
+  char *newbuf, *p;
+  int i, result;
+
+  sa->sa_progname = kmalloc(PATH_MAX);
+  if (sa->sa_progname == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(prog, sa->sa_progname, PATH_MAX, NULL);
+  if (result) {
+    return result;
+  }
+
+  /* count the arguments; the pointers count against ARG_MAX too */
+  for (sa->sa_argc = 0; ; sa->sa_argc++) {
+    if ((sa->sa_argc + 1) * sizeof(userptr_t) > ARG_MAX) {
+      return E2BIG;
+    }
+    result = copyin(args + sa->sa_argc * sizeof(userptr_t), &uarg,
+                    sizeof(uarg));
+    if (result) {
+      return result;
+    }
+    if (uarg == NULL) {
+      break;
+    }
+  }
+
+  sa->sa_argv = kmalloc((sa->sa_argc + 1) * sizeof(char *));
+  if (sa->sa_argv == NULL) {
+    return ENOMEM;
+  }
+  /* the strings go one after another in sa_argbuf, which is */
+  /* kept small for the usual short command line               */
+  space = ARG_MAX - (sa->sa_argc + 1) * sizeof(userptr_t);
+  if (space == 0) {
+    return E2BIG;
+  }
+  size = space < SPAWN_ARGBUF_MIN ? space : SPAWN_ARGBUF_MIN;
+  sa->sa_argbuf = kmalloc(size);
+  if (sa->sa_argbuf == NULL) {
+    return ENOMEM;
+  }
+  used = 0;
+  for (i = 0; i < sa->sa_argc; ) {
+    result = copyin(args + i * sizeof(userptr_t), &uarg, sizeof(uarg));
+    if (result) {
+      return result;
+    }
+    result = copyinstr(uarg, sa->sa_argbuf + used, size - used, &got);
+    if (result == ENAMETOOLONG && size < space) {
+      /* grow the buffer and try this string again */
+      size = size * 2 < space ? size * 2 : space;
+      newbuf = kmalloc(size);
+      if (newbuf == NULL) {
+        return ENOMEM;
+      }
+      memcpy(newbuf, sa->sa_argbuf, used);
+      kfree(sa->sa_argbuf);
+      sa->sa_argbuf = newbuf;
+      continue;
+    }
+    if (result) {
+      return result == ENAMETOOLONG ? E2BIG : result;
+    }
+    used += got;
+    i++;
+  }
+
+  /* only now that the buffer has stopped moving, point at the strings */
+  p = sa->sa_argbuf;
+  for (i = 0; i < sa->sa_argc; i++) {
+    sa->sa_argv[i] = p;
+    p += strlen(p) + 1;
+  }
+  sa->sa_argv[sa->sa_argc] = NULL;
+  return 0;
+}
+
+/* thread_fork entry point for the child of a spawn() */
+static void
+spawn_child_start(void *data1, unsigned long data2)
+{
+  struct spawnargs *sa = data1;
+  vaddr_t entrypoint, stackptr;
+  userptr_t uargv;
+  int argc, result;
+
+  (void)data2;
+
+  argc = sa->sa_argc;
+  result = loadprogram(sa->sa_progname, sa->sa_argc, sa->sa_argv,
+                       &entrypoint, &stackptr, &uargv);
+
+  /* sa belongs to the parent again once we post sa_loaded */
+  sa->sa_result = result;
+  V(sa->sa_loaded);
+
+  if (result) {
+    /* the parent reports the error and reaps us */
+    exit_curproc(_MKWAIT_EXIT(255));
+  }
+  enter_new_process(argc, uargv, stackptr, entrypoint);
+  panic("enter_new_process returned\n");
+}
+
+/* handler for spawn() system call                               */
+/* like fork() followed by execv() in the child, but the child   */
+/* gets a new address space straight away instead of a copy of   */
+/* the parent's; errors loading the program are returned here    */
+int
+sys_spawn(userptr_t prog, userptr_t args, pid_t *retval)
+{
+  struct spawnargs sa;
+  struct proc *child;
+  pid_t pid;
+  int result;
+
+  sa.sa_progname = NULL;
+  sa.sa_argc = 0;
+  sa.sa_argv = NULL;
+  sa.sa_argbuf = NULL;
+  sa.sa_loaded = NULL;
+  sa.sa_result = 0;
+
+  result = spawnargs_copyin(&sa, prog, args);
+  if (result) {
+    spawnargs_cleanup(&sa);
+    return result;
+  }
+
+  DEBUG(DB_SYSCALL,"Syscall: spawn(%s)\n",sa.sa_progname);
+
+  sa.sa_loaded = sem_create("spawn", 0);
+  if (sa.sa_loaded == NULL) {
+    spawnargs_cleanup(&sa);
+    return ENOMEM;
+  }
+
+  /* loadprogram may destroy sa_progname, so name everything first */
+  child = proc_create_runprogram(sa.sa_progname);
+  if (child == NULL) {
+    spawnargs_cleanup(&sa);
+    return ENOMEM;
+  }
+  pid = child->p_pid;
+
+  result = thread_fork(sa.sa_progname, child, spawn_child_start, &sa, 0);
+  if (result) {
+    proc_destroy(child);
+    spawnargs_cleanup(&sa);
+    return result;
+  }
+
+  P(sa.sa_loaded);
+  result = sa.sa_result;
+  spawnargs_cleanup(&sa);
+
+  if (result) {
+    /* the child is exiting; nobody else knows it exists */
+    if (proc_waitchild(pid, &child) == 0) {
+      proc_reap(child);
+    }
+    return result;
+  }
+
+  *retval = pid;
+  return 0;
+}
@@ -37,6 +37,7 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -46,17 +47,68 @@
 #include <test.h>
 
 /*
- * Load program "progname" and start running it in usermode.
- * Does not return except on error.
+ * Copy the ARGC strings in ARGV onto the user stack below *STACKPTR,
+ * followed (further down) by the NULL-terminated array of pointers
+ * to them. Hands back the user address of the array in *UARGV, which
+ * is also the new stack pointer.
+ */
+static
+int
+copyout_args(int argc, char **argv, vaddr_t *stackptr, userptr_t *uargv)
+{
+	vaddr_t strp, argvp;
+	userptr_t uarg;
+	size_t len, total;
+	int i, result;
+
+	total = 0;
+	for (i=0; i<argc; i++) {
+		total += strlen(argv[i]) + 1;
+	}
+	strp = *stackptr - total;
+	/* The stack pointer must stay 8-byte aligned. */
+	argvp = (strp - (argc + 1) * sizeof(userptr_t)) & ~(vaddr_t)7;
+
+	for (i=0; i<=argc; i++) {
+		uarg = NULL;
+		if (i < argc) {
+			len = strlen(argv[i]) + 1;
+			result = copyoutstr(argv[i], (userptr_t)strp, len,
+					    NULL);
+			if (result) {
+				return result;
+			}
+			uarg = (userptr_t)strp;
+			strp += len;
+		}
+		result = copyout(&uarg,
+				 (userptr_t)(argvp + i * sizeof(userptr_t)),
+				 sizeof(uarg));
+		if (result) {
+			return result;
+		}
+	}
+
+	*stackptr = argvp;
+	*uargv = (userptr_t)argvp;
+	return 0;
+}
+
+/*
+ * Load program "progname" into a new address space for the current
+ * process, which must not have one yet, and put the ARGC arguments
+ * in ARGV on its stack. Hands back the entry point, the initial stack
+ * pointer, and the user address of the argument vector (NULL if
+ * there are no arguments) for enter_new_process.
  *
  * Calls vfs_open on progname and thus may destroy it.
  */
 int
-runprogram(char *progname)
+loadprogram(char *progname, int argc, char **argv,
+	    vaddr_t *entrypoint, vaddr_t *stackptr, userptr_t *uargv)
 {
 	struct addrspace *as;
 	struct vnode *v;
-	vaddr_t entrypoint, stackptr;
 	int result;
 
 	/* Open the file. */
@@ -80,7 +132,7 @@ runprogram(char *progname)
 	as_activate();
 
 	/* Load the executable. */
-	result = load_elf(v, &entrypoint);
+	result = load_elf(v, entrypoint);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		vfs_close(v);
@@ -91,14 +143,46 @@ runprogram(char *progname)
 	vfs_close(v);
 
 	/* Define the user stack in the address space */
-	result = as_define_stack(as, &stackptr);
+	result = as_define_stack(as, stackptr);
 	if (result) {
 		/* p_addrspace will go away when curproc is destroyed */
 		return result;
 	}
 
+	/* Copy the arguments onto it */
+	*uargv = NULL;
+	if (argc > 0) {
+		result = copyout_args(argc, argv, stackptr, uargv);
+		if (result) {
+			/* p_addrspace will go away when curproc is destroyed */
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Load program "progname" and start running it in usermode.
+ * Does not return except on error.
+ *
+ * Calls vfs_open on progname and thus may destroy it.
+ */
+int
+runprogram(char *progname)
+{
+	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
+	int result;
+
+	result = loadprogram(progname, 0, NULL,
+			     &entrypoint, &stackptr, &uargv);
+	if (result) {
+		return result;
+	}
+
 	/* Warp to user mode. */
-	enter_new_process(0 /*argc*/, NULL /*userspace addr of argv*/,
+	enter_new_process(0 /*argc*/, uargv /*userspace addr of argv*/,
 			  stackptr, entrypoint);
 	
 	/* enter_new_process does not return. */
@@ -55,6 +55,9 @@
 #define NCHUNKS  720
 #define NTHREADS 12
 #define NCREATES 32
+#define NBIGFILES 2
+#define BIGCHUNK  512
+#define BIGSIZE   (2*1024*1024)
 
 static struct semaphore *threadsem = NULL;
 
@@ -537,6 +540,153 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Fill BUF with what goes at chunk CHUNK of big file NUM.
+ */
+static
+void
+bigfill(char *buf, unsigned long num, unsigned chunk)
+{
+	unsigned i;
+
+	snprintf(buf, BIGCHUNK, "file %lu chunk %u\n", num, chunk);
+	for (i=strlen(buf); i<BIGCHUNK; i++) {
+		buf[i] = 'A' + (num + chunk + i) % 26;
+	}
+}
+
+/*
+ * Write big file NUM a chunk at a time, then read it back and check
+ * it. With the other threads doing the same at once, the file system
+ * allocates blocks for all the files together, so on an SFS volume
+ * made with mksfs -e each file ends up in many extents unless the
+ * file system keeps them apart.
+ */
+static
+int
+bigwrite_file(const char *filesys, unsigned long num, char *buf, char *rbuf)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	char numstr[8];
+	unsigned i, j;
+	int err;
+
+	snprintf(numstr, sizeof(numstr), "big%lu", num);
+	fstest_makename(name, sizeof(name), filesys, numstr);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	err = vfs_open(buf, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for write: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+	for (i=0; i<BIGSIZE/BIGCHUNK; i++) {
+		bigfill(buf, num, i);
+		uio_kinit(&iov, &ku, buf, BIGCHUNK, (off_t)i * BIGCHUNK,
+			  UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Write error at chunk %u: %s\n", name, i,
+				err ? strerror(err) : "short write");
+			vfs_close(vn);
+			fstest_remove(filesys, numstr);
+			return -1;
+		}
+	}
+	vfs_close(vn);
+	kprintf("%s: %lu bytes written\n", name, (unsigned long) BIGSIZE);
+
+	strcpy(buf, name);
+	err = vfs_open(buf, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("Could not open %s for read: %s\n",
+			name, strerror(err));
+		return -1;
+	}
+	for (i=0; i<BIGSIZE/BIGCHUNK; i++) {
+		uio_kinit(&iov, &ku, rbuf, BIGCHUNK, (off_t)i * BIGCHUNK,
+			  UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("%s: Read error at chunk %u: %s\n", name, i,
+				err ? strerror(err) : "short read");
+			vfs_close(vn);
+			return -1;
+		}
+		bigfill(buf, num, i);
+		for (j=0; j<BIGCHUNK; j++) {
+			if (buf[j] != rbuf[j]) {
+				kprintf("%s: Test failed: chunk %u "
+					"mismatched at byte %u\n",
+					name, i, j);
+				vfs_close(vn);
+				return -1;
+			}
+		}
+	}
+	vfs_close(vn);
+	kprintf("%s: %lu bytes read\n", name, (unsigned long) BIGSIZE);
+
+	return fstest_remove(filesys, numstr);
+}
+
+static
+void
+bigwrite_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	char *buf, *rbuf;
+
+	buf = kmalloc(BIGCHUNK);
+	rbuf = kmalloc(BIGCHUNK);
+	if (buf == NULL || rbuf == NULL) {
+		kprintf("*** Thread %lu: out of memory\n", num);
+	}
+	else if (bigwrite_file(filesys, num, buf, rbuf)) {
+		kprintf("*** Thread %lu: failed\n", num);
+	}
+	else {
+		kprintf("*** Thread %lu: done\n", num);
+	}
+	kfree(buf);
+	kfree(rbuf);
+
+	V(threadsem);
+}
+
+static
+void
+dobigwrite(const char *filesys)
+{
+	int i, err;
+
+	init_threadsem();
+
+	kprintf("*** Starting fs big write test on %s:\n", filesys);
+
+	for (i=0; i<NBIGFILES; i++) {
+		err = thread_fork("bigwrite", NULL,
+				  bigwrite_thread, (char *)filesys, i);
+		if (err) {
+			panic("bigwrite: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+
+	for (i=0; i<NBIGFILES; i++) {
+		P(threadsem);
+	}
+
+	kprintf("*** fs big write test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -544,7 +694,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +726,7 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(bigwrite);
 
 ////////////////////////////////////////////////////////////
 
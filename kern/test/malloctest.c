@@ -32,9 +32,14 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <current.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
+#include <platform/maxcpus.h>
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -137,3 +142,136 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Benchmark kmalloc; NTHREADS threads each allocate and free a block
+ * of every size in benchsizes[], BENCHROUNDS times over, and we
+ * report how many calls each cpu got through per second. Unlike
+ * mallocstress this doesn't try to run out of memory; it is meant to
+ * measure how well the allocator scales with the number of cpus.
+ */
+
+#define BENCHROUNDS 2000
+
+static const size_t benchsizes[] = { 8, 24, 48, 100, 200, 400, 1000, 2000 };
+#define NBENCHSIZES (sizeof(benchsizes) / sizeof(benchsizes[0]))
+
+static struct spinlock bench_lock = SPINLOCK_INITIALIZER;
+static unsigned long bench_cpucalls[MAXCPUS];
+static bool bench_failed;
+
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	unsigned long calls[MAXCPUS];
+	void *ptrs[NBENCHSIZES];
+	unsigned i, j;
+
+	for (i=0; i<MAXCPUS; i++) {
+		calls[i] = 0;
+	}
+
+	for (i=0; i<BENCHROUNDS; i++) {
+		for (j=0; j<NBENCHSIZES; j++) {
+			ptrs[j] = kmalloc(benchsizes[j]);
+			if (ptrs[j] == NULL) {
+				kprintf("thread %lu: kmalloc returned NULL\n",
+					num);
+				while (j-- > 0) {
+					kfree(ptrs[j]);
+				}
+				spinlock_acquire(&bench_lock);
+				bench_failed = true;
+				spinlock_release(&bench_lock);
+				V(sem);
+				return;
+			}
+		}
+		for (j=0; j<NBENCHSIZES; j++) {
+			kfree(ptrs[j]);
+		}
+		/* We may have moved cpus in the middle; close enough. */
+		calls[curcpu->c_number] += 2 * NBENCHSIZES;
+	}
+
+	spinlock_acquire(&bench_lock);
+	for (i=0; i<MAXCPUS; i++) {
+		bench_cpucalls[i] += calls[i];
+	}
+	spinlock_release(&bench_lock);
+
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	unsigned long ms, total;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	for (i=0; i<MAXCPUS; i++) {
+		bench_cpucalls[i] = 0;
+	}
+	bench_failed = false;
+
+	kprintf("Starting kmalloc benchmark...\n");
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("mallocbench", NULL,
+				     mallocbenchthread, sem, i);
+		if (result) {
+			panic("mallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	sem_destroy(sem);
+
+	if (bench_failed) {
+		kprintf("kmalloc benchmark failed\n");
+		return 0;
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+	ms = secs2 * 1000 + nsecs2 / 1000000;
+	if (ms == 0) {
+		ms = 1;
+	}
+
+	total = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		if (bench_cpucalls[i] == 0) {
+			continue;
+		}
+		kprintf("cpu%d: %lu calls, %lu per second\n", i,
+			bench_cpucalls[i],
+			(unsigned long)((uint64_t)bench_cpucalls[i] * 1000 / ms));
+		total += bench_cpucalls[i];
+	}
+	kprintf("total: %lu calls in %lu.%03lu seconds, %lu per second\n",
+		total, ms / 1000, ms % 1000,
+		(unsigned long)((uint64_t)total * 1000 / ms));
+
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
@@ -37,6 +37,7 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 
@@ -194,9 +195,42 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Locks are adaptive: while the holder is running on another cpu it
+ * is probably about to let go, and waiting for it by spinning is
+ * cheaper than sleeping and being woken again. So lock_acquire polls
+ * the lock, without holding the spinlock so the holder can get at
+ * it, and looks again every LOCK_SPINPOLL polls at whether the holder
+ * is still running. Only when the holder has been descheduled, or
+ * after LOCK_MAXSPIN polls in all, does it go to sleep.
+ */
+#define LOCK_SPINPOLL   100
+#define LOCK_MAXSPIN    10000
+
+/*
+ * Is the holder of LOCK running on some other cpu right now? The
+ * caller must hold the lock's spinlock, which keeps the holder from
+ * releasing the lock and going away while we look at it. Its state
+ * is read without its cpu's run queue lock, so this is only a hint.
+ */
+static
+bool
+lock_holder_running(struct lock *lock)
+{
+        struct thread *owner;
+
+        KASSERT(spinlock_do_i_hold(&lock->spinlock));
+
+        owner = lock->owner;
+        return owner != NULL && owner->t_state == S_RUN &&
+                owner->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+        unsigned spins, i;
+
         KASSERT(lock != NULL);
         KASSERT(!lock_do_i_hold(lock));
         /*
@@ -209,7 +243,17 @@ lock_acquire(struct lock *lock)
 
 	spinlock_acquire(&lock->spinlock);
 
+        spins = 0;
         while (lock->held) {
+                if (spins < LOCK_MAXSPIN && lock_holder_running(lock)) {
+                        spinlock_release(&lock->spinlock);
+                        for (i=0; i<LOCK_SPINPOLL && lock->held; i++) {
+                                /* spin */
+                        }
+                        spins += i + 1;
+                        spinlock_acquire(&lock->spinlock);
+                        continue;
+                }
                 wchan_lock(lock->wchan);
                 spinlock_release(&lock->spinlock);
                 wchan_sleep(lock->wchan);
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
 
@@ -72,6 +73,9 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Work stealing; see thread_consider_migration. */
+static bool thread_steal(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -143,6 +147,9 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_sched_ticks = 0;
+	thread->t_migrated = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -168,6 +175,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -182,7 +190,9 @@ cpu_create(unsigned hardware_number)
 	c->c_hardclocks = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -289,6 +299,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +315,11 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +440,114 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. Each cpu has one queue per priority level;
+ * the caller must hold the cpu's run queue lock.
+ *
+ * runqueue_count   - number of threads waiting on cpu C at priority
+ *                    LEVEL or better.
+ * runqueue_add     - add T to the back of the queue for its priority.
+ * runqueue_remnext - take the thread that should run next: the first
+ *                    one at the highest priority that has any.
+ * runqueue_steal   - take a thread for another cpu to run, starting
+ *                    with the one that would run last. Threads that
+ *                    only recently arrived on C are left alone, which
+ *                    keeps a thread from bouncing between cpus faster
+ *                    than it can warm up a cache; so is C's curthread,
+ *                    which can be on its own run queue while C is
+ *                    idle (see thread_switch) and must not be moved.
+ */
+
+/* How long a thread is left on a cpu it has just been moved to. */
+#define SCHED_AFFINITY_HARDCLOCKS	8
+static
+unsigned
+runqueue_count(struct cpu *c, unsigned level)
+{
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(level < SCHED_NLEVELS);
+	n = 0;
+	for (i=0; i<=level; i++) {
+		n += c->c_runqueue[i].tl_count;
+	}
+	return n;
+}
+
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+}
+
+static
+struct thread *
+runqueue_remnext(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+static
+struct thread *
+runqueue_steal(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		THREADLIST_FORALL_REV(t, c->c_runqueue[i]) {
+			if (t == c->c_curthread) {
+				continue;
+			}
+			if (c->c_hardclocks - t->t_migrated <
+			    SCHED_AFFINITY_HARDCLOCKS) {
+				continue;
+			}
+			threadlist_remove(&c->c_runqueue[i], t);
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Interrupt one idle cpu other than EXCEPT, if there is one, so that
+ * it looks for work to steal. c_isidle is read without the run queue
+ * lock; it's only a hint, and waking a cpu that has just found work
+ * of its own does no harm.
+ */
+static
+void
+thread_unidle_peer(struct cpu *except)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != except && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +572,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +580,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		/*
+		 * It will have to wait. If some other processor has
+		 * nothing to do, wake it up so it comes and steals.
+		 */
+		thread_unidle_peer(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -528,6 +657,10 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
+	/* A new thread has no cache state worth staying on this cpu for. */
+	newthread->t_migrated =
+		newthread->t_cpu->c_hardclocks - SCHED_AFFINITY_HARDCLOCKS;
+
 	/* Lock the current cpu's run queue and make the new thread runnable */
 	thread_make_runnable(newthread, false);
 
@@ -573,8 +706,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. Nothing
+	 * to do includes there being only less important threads
+	 * waiting, since we'd be picked again straight away.
+	 */
+	if (newstate == S_READY &&
+	    runqueue_count(curcpu, cur->t_priority) == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -627,15 +765,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before actually idling, try to steal work from another cpu.
 	 */
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remnext(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -824,137 +966,156 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
+ *
+ * This is a multilevel feedback queue. Threads start at the highest
+ * priority (level 0) and always run ahead of anything waiting at a
+ * lower one; within a level they take turns. Each time we're called
+ * the running thread is charged one period, and once it has used up
+ * its allotment at its level it drops to the next. So a thread that
+ * computes without stopping sinks to the bottom, while one that
+ * mostly waits for I/O (and is bumped back up a level each time it
+ * wakes, see wchan_wake*) stays near the top and gets the CPU
+ * quickly when it wants it.
+ *
+ * So that nothing at the bottom starves, once a second everything on
+ * this CPU is put back at level 0.
  */
 
+/* Periods a thread may be charged at level L before dropping a level */
+#define SCHED_ALLOTMENT(l)	(2U << (l))
+
+/* How often to boost everything back to level 0 */
+#define SCHED_BOOST_HARDCLOCKS	HZ
+
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *cur, *t;
+	unsigned i;
+
+	cur = curthread;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+
+	if (!curcpu->c_isidle) {
+		cur->t_sched_ticks++;
+		if (cur->t_sched_ticks >= SCHED_ALLOTMENT(cur->t_priority) &&
+		    cur->t_priority < SCHED_NLEVELS - 1) {
+			/* Demote; takes effect when it is next requeued. */
+			cur->t_priority++;
+			cur->t_sched_ticks = 0;
+		}
+	}
+
+	if ((curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS) == 0) {
+		for (i=1; i<SCHED_NLEVELS; i++) {
+			while ((t = threadlist_remhead(&curcpu->c_runqueue[i]))
+			       != NULL) {
+				t->t_priority = 0;
+				t->t_sched_ticks = 0;
+				threadlist_addtail(&curcpu->c_runqueue[0], t);
+			}
+		}
+		if (!curcpu->c_isidle) {
+			cur->t_priority = 0;
+			cur->t_sched_ticks = 0;
+		}
+	}
+
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Threads are moved by the cpu that wants them, not pushed away by
+ * the one that has too many: a cpu with nothing left to run steals
+ * from the busiest other cpu before going idle (see thread_switch),
+ * and thread_consider_migration does the same periodically for a cpu
+ * that is busy but has nothing waiting behind its current thread.
+ * Busy cpus thus never spend time looking at other cpus, and work
+ * moves as soon as some cpu could run it.
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * which is fairly slow. So the thread taken is the one the victim
+ * would run last, and a thread that was moved recently is not moved
+ * again until it has had a chance to settle (see runqueue_steal).
+ */
+
+/*
+ * Take one thread from the cpu with the most threads waiting and
+ * put it on our own run queue. Returns false if there was nothing
+ * suitable to take.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * The counts used to choose the victim are read without locking;
+ * they're just a hint, and if the victim turns out to have nothing
+ * we can take we simply give up until next time.
  */
-void
-thread_consider_migration(void)
+static
+bool
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct cpu *c, *victim;
 	struct thread *t;
+	unsigned i, j, numcpus, n, most;
 
-	my_count = total_count = 0;
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			continue;
+		}
+		n = 0;
+		for (j=0; j<SCHED_NLEVELS; j++) {
+			n += c->c_runqueue[j].tl_count;
+		}
+		if (n > most) {
+			most = n;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return false;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_steal(victim);
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+	if (t == NULL) {
+		return false;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
+	DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+	      t->t_name, victim->c_number, curcpu->c_number);
+
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
+	t->t_migrated = curcpu->c_hardclocks;
+	runqueue_add(curcpu, t);
 	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+/*
+ * This is called periodically from hardclock().
+ */
+void
+thread_consider_migration(void)
+{
+	unsigned count;
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	count = runqueue_count(curcpu, SCHED_NLEVELS - 1);
+	spinlock_release(&curcpu->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (count == 0) {
+		thread_steal();
 	}
-
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1028,6 +1189,21 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * A thread woken from a wait channel has been waiting rather than
+ * computing, so move it up a priority level. The caller has taken it
+ * off the channel and so owns it.
+ */
+static
+void
+wchan_boost(struct thread *target)
+{
+	if (target->t_priority > 0) {
+		target->t_priority--;
+	}
+	target->t_sched_ticks = 0;
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,6 +1226,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	wchan_boost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1084,6 +1261,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		wchan_boost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1162,6 +1340,23 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -0,0 +1,1012 @@
+/*
+ * Buffer cache. See buf.h.
+ *
+ * Buffers are found through a hash table keyed on (device, block),
+ * and all of them are kept on one list in order of last use. A block
+ * that isn't cached goes into a new buffer while there are fewer than
+ * buf_max, which is a fixed fraction of physical memory, and after
+ * that into the least recently used buffer nobody is holding.
+ *
+ * buf_lock protects the hash table, the list and the buffer headers.
+ * A buffer that has been handed out, or is being read or written, is
+ * marked busy; its owner uses the contents without holding buf_lock,
+ * so that other blocks can be looked up while it waits for the disk.
+ * Threads waiting for a busy buffer, or for any buffer at all when
+ * every one is busy, sleep on buf_cv.
+ *
+ * Read-ahead requests are queued for a thread of our own, which reads
+ * them into the cache while the requester goes on with what it was
+ * doing.
+ *
+ * Another thread, the syncer, writes modified buffers back in the
+ * background, so that they are mostly clean by the time they are
+ * evicted and nothing stays unwritten for long. See buf_syncthread.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <mainbus.h>
+#include <device.h>
+#include <buf.h>
+
+struct buf {
+	struct buf *b_hashnext;		/* next in hash chain */
+	struct buf *b_lrunext;		/* next more recently used */
+	struct buf *b_lruprev;		/* next less recently used */
+	struct device *b_dev;		/* NULL if holding no block */
+	uint32_t b_block;		/* block number on b_dev */
+	bool b_busy;			/* handed out or doing I/O */
+	bool b_dirty;			/* must be written before reuse */
+	time_t b_dirtytime;		/* when b_dirty was last set */
+	void *b_data;			/* BUF_BLOCKSIZE bytes */
+};
+
+/* Allow at most this fraction of RAM for cached blocks. */
+#define BUF_RAMFRACTION  32
+#define BUF_MINBUFS      16
+
+#define BUF_HASHSIZE     127
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;
+
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *buf_lruhead;		/* least recently used */
+static struct buf *buf_lrutail;		/* most recently used */
+
+static unsigned buf_num;		/* buffers allocated */
+static unsigned buf_max;		/* buffers allowed */
+static unsigned buf_ndirty;		/* buffers with b_dirty set */
+
+/* Write back buffers that have been dirty this long (seconds). */
+#define BUF_SYNCINTERVAL  5
+static volatile unsigned buf_syncinterval = BUF_SYNCINTERVAL;
+
+/* Read-ahead queue, also protected by buf_lock */
+#define BUF_RAQUEUESIZE  32
+
+static struct {
+	struct device *ra_dev;
+	uint32_t ra_block;
+} buf_raqueue[BUF_RAQUEUESIZE];
+static unsigned buf_rahead, buf_racount;
+static struct device *buf_radev;	/* device being read ahead on */
+static struct cv *buf_racv;		/* signalled when queue nonempty */
+
+static void buf_readaheadthread(void *, unsigned long);
+static void buf_syncthread(void *, unsigned long);
+
+void
+buf_bootstrap(void)
+{
+	int result;
+
+	buf_lock = lock_create("buf");
+	buf_cv = cv_create("buf");
+	buf_racv = cv_create("bufreadahead");
+	if (buf_lock == NULL || buf_cv == NULL || buf_racv == NULL) {
+		panic("buf_bootstrap: Out of memory\n");
+	}
+
+	buf_max = mainbus_ramsize() / BUF_RAMFRACTION / BUF_BLOCKSIZE;
+	if (buf_max < BUF_MINBUFS) {
+		buf_max = BUF_MINBUFS;
+	}
+
+	result = thread_fork("bufreadahead", NULL, buf_readaheadthread,
+			     NULL, 0);
+	if (result) {
+		panic("buf_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+	result = thread_fork("bufsync", NULL, buf_syncthread, NULL, 0);
+	if (result) {
+		panic("buf_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Hash table and LRU list
+
+static
+unsigned
+buf_hashslot(struct device *dev, uint32_t block)
+{
+	return (((uintptr_t)dev >> 4) + block) % BUF_HASHSIZE;
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, uint32_t block)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	for (b = buf_hash[buf_hashslot(dev, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashinsert(struct buf *b)
+{
+	unsigned slot;
+
+	KASSERT(b->b_dev != NULL);
+	slot = buf_hashslot(b->b_dev, b->b_block);
+	b->b_hashnext = buf_hash[slot];
+	buf_hash[slot] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **bp;
+
+	KASSERT(b->b_dev != NULL);
+	for (bp = &buf_hash[buf_hashslot(b->b_dev, b->b_block)];
+	     *bp != b; bp = &(*bp)->b_hashnext) {
+		KASSERT(*bp != NULL);
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+}
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/* Put B at the most recently used end. */
+static
+void
+buf_lruaddtail(struct buf *b)
+{
+	b->b_lruprev = buf_lrutail;
+	b->b_lrunext = NULL;
+	if (buf_lrutail != NULL) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put B at the least recently used end, to be reused first. */
+static
+void
+buf_lruaddhead(struct buf *b)
+{
+	b->b_lrunext = buf_lruhead;
+	b->b_lruprev = NULL;
+	if (buf_lruhead != NULL) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+/*
+ * Forget the block B holds, and make B the next buffer to be reused.
+ */
+static
+void
+buf_disown(struct buf *b)
+{
+	buf_hashremove(b);
+	b->b_dev = NULL;
+	if (b->b_dirty) {
+		b->b_dirty = false;
+		buf_ndirty--;
+	}
+	buf_lruremove(b);
+	buf_lruaddhead(b);
+}
+
+////////////////////////////////////////////////////////////
+//
+// I/O
+
+/*
+ * Set up a device request to read or write the block in B.
+ */
+static
+void
+buf_initreq(struct buf *b, enum uio_rw rw, struct devreq *req)
+{
+	req->dr_block = b->b_block;
+	req->dr_nblocks = 1;
+	req->dr_data = b->b_data;
+	req->dr_write = (rw == UIO_WRITE);
+	req->dr_callback = NULL;
+	req->dr_arg = NULL;
+}
+
+/*
+ * Read or write the block in B, through d_submit if the device has
+ * it. EIO is retried a few times before we give up on it.
+ */
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	struct devreq req;
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(b->b_busy);
+
+	DEBUG(DB_VFS, "buf: %s %u\n",
+	      rw == UIO_READ ? "read" : "write", b->b_block);
+
+ retry:
+	if (b->b_dev->d_submit != NULL) {
+		buf_initreq(b, rw, &req);
+		result = b->b_dev->d_submit(b->b_dev, &req);
+		if (result == 0) {
+			b->b_dev->d_wait(b->b_dev, &req);
+			result = req.dr_result;
+		}
+	}
+	else {
+		uio_kinit(&iov, &ku, b->b_data, BUF_BLOCKSIZE,
+			  ((off_t)b->b_block) * BUF_BLOCKSIZE, rw);
+		result = b->b_dev->d_io(b->b_dev, &ku);
+	}
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+	return result;
+}
+
+/*
+ * Write out the dirty buffer B, which the caller has marked busy.
+ * buf_lock is dropped during the write.
+ */
+static
+int
+buf_writeback(struct buf *b)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	lock_release(buf_lock);
+	result = buf_io(b, UIO_WRITE);
+	lock_acquire(buf_lock);
+
+	if (result == 0) {
+		b->b_dirty = false;
+		buf_ndirty--;
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Getting and releasing buffers
+
+/*
+ * Find a buffer to hold a block that isn't cached: a new one if we're
+ * allowed more, otherwise the least recently used one that isn't
+ * busy. Returns NULL if every buffer is busy.
+ */
+static
+struct buf *
+buf_findspare(void)
+{
+	struct buf *b;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	if (buf_num < buf_max) {
+		b = kmalloc(sizeof(struct buf));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUF_BLOCKSIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			b->b_hashnext = NULL;
+			b->b_dev = NULL;
+			b->b_block = 0;
+			b->b_busy = false;
+			b->b_dirty = false;
+			b->b_dirtytime = 0;
+			buf_lruaddhead(b);
+			buf_num++;
+			return b;
+		}
+		/* Out of memory; make do with the buffers we have. */
+	}
+
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Get block BLOCK of DEV, busy. If it wasn't cached, it is given a
+ * buffer whose contents are garbage and *FRESH is set; the caller
+ * must fill it in, or give it up with buf_abandon.
+ *
+ * If NOWAIT is set, fail with EAGAIN instead of waiting for the block
+ * or for a free buffer.
+ */
+static
+int
+buf_claim(struct device *dev, uint32_t block, bool nowait,
+	  struct buf **ret, bool *fresh)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+	lock_acquire(buf_lock);
+
+ again:
+	b = buf_lookup(dev, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			if (nowait) {
+				lock_release(buf_lock);
+				return EAGAIN;
+			}
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		b->b_busy = true;
+		lock_release(buf_lock);
+		*ret = b;
+		*fresh = false;
+		return 0;
+	}
+
+	b = buf_findspare();
+	if (b == NULL) {
+		if (nowait) {
+			lock_release(buf_lock);
+			return EAGAIN;
+		}
+		cv_wait(buf_cv, buf_lock);
+		goto again;
+	}
+
+	if (b->b_dirty) {
+		/*
+		 * Write the old contents back first. Someone may
+		 * load our block while we wait for that, so start
+		 * over afterwards; the buffer is clean next time.
+		 */
+		b->b_busy = true;
+		result = buf_writeback(b);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+		goto again;
+	}
+
+	if (b->b_dev != NULL) {
+		buf_hashremove(b);
+	}
+	b->b_dev = dev;
+	b->b_block = block;
+	b->b_busy = true;
+	buf_hashinsert(b);
+
+	/* Anyone else looking for the block waits until we're done. */
+	lock_release(buf_lock);
+	*ret = b;
+	*fresh = true;
+	return 0;
+}
+
+/*
+ * Give up a fresh buffer from buf_claim that couldn't be filled in.
+ */
+static
+void
+buf_abandon(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	buf_disown(b);
+	b->b_busy = false;
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+int
+buf_read(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	bool fresh;
+	int result;
+
+	result = buf_claim(dev, block, false, &b, &fresh);
+	if (result) {
+		return result;
+	}
+	if (fresh) {
+		result = buf_io(b, UIO_READ);
+		if (result) {
+			buf_abandon(b);
+			return result;
+		}
+	}
+	*ret = b;
+	return 0;
+}
+
+int
+buf_get(struct device *dev, uint32_t block, struct buf **ret)
+{
+	struct buf *b;
+	bool fresh;
+	int result;
+
+	result = buf_claim(dev, block, false, &b, &fresh);
+	if (result) {
+		return result;
+	}
+	if (fresh) {
+		bzero(b->b_data, BUF_BLOCKSIZE);
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Only the first block is waited for. The rest are claimed without
+ * waiting, and the run ends at the first one that can't be: so a
+ * thread never waits for a buffer while holding others, and two
+ * threads reading runs can't deadlock over the last free buffers.
+ *
+ * The reads are all submitted before any is waited for, as in
+ * buf_readaheadthread. Consecutive blocks submitted together are
+ * merged by the disk scheduler and go to the disk back to back. If
+ * one fails, the run ends before it.
+ */
+int
+buf_readrun(struct device *dev, uint32_t block, unsigned n,
+	    struct buf **bufs, unsigned *got)
+{
+	struct devreq reqs[BUF_MAXRUN];
+	bool fresh[BUF_MAXRUN], submitted[BUF_MAXRUN];
+	unsigned i, count;
+	int result, ret;
+
+	KASSERT(n > 0 && n <= BUF_MAXRUN);
+
+	result = buf_claim(dev, block, false, &bufs[0], &fresh[0]);
+	if (result) {
+		return result;
+	}
+	for (count=1; count<n; count++) {
+		if (buf_claim(dev, block + count, true, &bufs[count],
+			      &fresh[count])) {
+			break;
+		}
+	}
+
+	for (i=0; i<count; i++) {
+		submitted[i] = false;
+		if (fresh[i] && dev->d_submit != NULL) {
+			buf_initreq(bufs[i], UIO_READ, &reqs[i]);
+			if (dev->d_submit(dev, &reqs[i]) == 0) {
+				submitted[i] = true;
+			}
+		}
+	}
+
+	/*
+	 * Wait for all of them, even after a failure, since the
+	 * requests live on our stack. Keep the ones before the first
+	 * failure and give up the rest.
+	 */
+	ret = 0;
+	*got = count;
+	for (i=0; i<count; i++) {
+		result = 0;
+		if (submitted[i]) {
+			dev->d_wait(dev, &reqs[i]);
+			result = reqs[i].dr_result;
+		}
+		if (fresh[i] && (!submitted[i] || result != 0) && i < *got) {
+			/* Not submitted, or failed: do it the slow way. */
+			result = buf_io(bufs[i], UIO_READ);
+		}
+		if (result != 0 && i < *got) {
+			*got = i;
+			if (i == 0) {
+				ret = result;
+			}
+		}
+	}
+	for (i=*got; i<count; i++) {
+		if (fresh[i]) {
+			buf_abandon(bufs[i]);
+		}
+		else {
+			buf_release(bufs[i]);
+		}
+	}
+
+	return ret;
+}
+
+void *
+buf_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+/*
+ * Only the owner of a busy buffer changes b_dirty, but buf_ndirty
+ * and b_dirtytime are looked at by the syncer, so they need the lock.
+ * Later changes to a buffer that is already dirty don't reset the
+ * time: they go out with the first.
+ */
+void
+buf_markdirty(struct buf *b)
+{
+	uint32_t nsecs;
+
+	KASSERT(b->b_busy);
+	if (b->b_dirty) {
+		return;
+	}
+	lock_acquire(buf_lock);
+	b->b_dirty = true;
+	gettime(&b->b_dirtytime, &nsecs);
+	buf_ndirty++;
+	lock_release(buf_lock);
+}
+
+void
+buf_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	buf_lruremove(b);
+	buf_lruaddtail(b);
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+/*
+ * Requests are dropped if the block is already cached or queued, or
+ * if the queue is full; a reader that gets ahead of us just reads
+ * the block itself. Anything still queued for a device that is being
+ * invalidated is thrown away (see buf_invalidate).
+ */
+void
+buf_readahead(struct device *dev, uint32_t block)
+{
+	unsigned i, slot;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+	lock_acquire(buf_lock);
+	if (buf_racount == BUF_RAQUEUESIZE || buf_lookup(dev, block) != NULL) {
+		lock_release(buf_lock);
+		return;
+	}
+	for (i=0; i<buf_racount; i++) {
+		slot = (buf_rahead + i) % BUF_RAQUEUESIZE;
+		if (buf_raqueue[slot].ra_dev == dev &&
+		    buf_raqueue[slot].ra_block == block) {
+			lock_release(buf_lock);
+			return;
+		}
+	}
+
+	slot = (buf_rahead + buf_racount) % BUF_RAQUEUESIZE;
+	buf_raqueue[slot].ra_dev = dev;
+	buf_raqueue[slot].ra_block = block;
+	buf_racount++;
+	cv_signal(buf_racv, buf_lock);
+	lock_release(buf_lock);
+}
+
+/*
+ * The read-ahead thread takes a batch of queued blocks for one device
+ * at a time and, if the device takes asynchronous requests, has them
+ * all in flight at once before waiting for any. It never waits for a
+ * buffer: a block somebody else has busy is being dealt with already,
+ * and if no buffer is free read-ahead isn't worth evicting for.
+ */
+#define BUF_RABATCH  8
+
+static
+void
+buf_readaheadthread(void *unused1, unsigned long unused2)
+{
+	struct device *dev;
+	struct buf *bufs[BUF_RABATCH];
+	struct devreq reqs[BUF_RABATCH];
+	uint32_t blocks[BUF_RABATCH];
+	unsigned i, n, nbufs;
+	bool fresh;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buf_lock);
+	for (;;) {
+		while (buf_racount == 0) {
+			cv_wait(buf_racv, buf_lock);
+		}
+
+		dev = buf_raqueue[buf_rahead].ra_dev;
+		n = 0;
+		while (n < BUF_RABATCH && buf_racount > 0 &&
+		       buf_raqueue[buf_rahead].ra_dev == dev) {
+			blocks[n++] = buf_raqueue[buf_rahead].ra_block;
+			buf_rahead = (buf_rahead + 1) % BUF_RAQUEUESIZE;
+			buf_racount--;
+		}
+
+		buf_radev = dev;
+		lock_release(buf_lock);
+
+		nbufs = 0;
+		for (i=0; i<n; i++) {
+			if (buf_claim(dev, blocks[i], true, &bufs[nbufs],
+				      &fresh)) {
+				continue;
+			}
+			if (!fresh) {
+				buf_release(bufs[nbufs]);
+				continue;
+			}
+			if (dev->d_submit != NULL) {
+				buf_initreq(bufs[nbufs], UIO_READ,
+					    &reqs[nbufs]);
+				result = dev->d_submit(dev, &reqs[nbufs]);
+				if (result) {
+					buf_abandon(bufs[nbufs]);
+					continue;
+				}
+			}
+			nbufs++;
+		}
+
+		/* Errors don't matter; whoever wants the block will see. */
+		for (i=0; i<nbufs; i++) {
+			if (dev->d_submit != NULL) {
+				dev->d_wait(dev, &reqs[i]);
+				result = reqs[i].dr_result;
+			}
+			else {
+				result = buf_io(bufs[i], UIO_READ);
+			}
+			if (result) {
+				buf_abandon(bufs[i]);
+			}
+			else {
+				buf_release(bufs[i]);
+			}
+		}
+
+		lock_acquire(buf_lock);
+		buf_radev = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Write-back
+
+/*
+ * The syncer wakes up once a second and writes back every buffer
+ * that has been dirty for buf_syncinterval seconds or more. Writes
+ * to a block within that time are absorbed by the cache and reach
+ * the disk once, so a file grown by many small appends costs one
+ * write per block rather than one per append.
+ *
+ * If more than 1/BUF_DIRTYHIGH of the buffers are dirty, it doesn't
+ * wait for them to age, but writes back the least recently used
+ * until only 1/BUF_DIRTYLOW are left, so that threads needing a
+ * buffer seldom have to write one back first.
+ *
+ * It works in batches of buffers picked in LRU order, and has every
+ * write of a batch in flight at once on devices that take
+ * asynchronous requests, so the disk scheduler can sort and merge
+ * them. Like read-ahead, it skips buffers somebody else has busy.
+ */
+#define BUF_SYNCBATCH  16
+#define BUF_DIRTYHIGH  2
+#define BUF_DIRTYLOW   4
+
+/*
+ * Write out the COUNT busy, dirty buffers in BUFS, and give them
+ * back. Returns nonzero if any of the writes failed; those buffers
+ * stay dirty. Called without buf_lock.
+ */
+static
+int
+buf_writebatch(struct buf **bufs, unsigned count)
+{
+	struct devreq reqs[BUF_SYNCBATCH];
+	int results[BUF_SYNCBATCH];
+	bool submitted[BUF_SYNCBATCH];
+	struct device *dev;
+	unsigned i;
+	int ret = 0;
+
+	KASSERT(count <= BUF_SYNCBATCH);
+
+	for (i=0; i<count; i++) {
+		dev = bufs[i]->b_dev;
+		submitted[i] = false;
+		if (dev->d_submit != NULL) {
+			buf_initreq(bufs[i], UIO_WRITE, &reqs[i]);
+			if (dev->d_submit(dev, &reqs[i]) == 0) {
+				submitted[i] = true;
+			}
+		}
+	}
+	for (i=0; i<count; i++) {
+		if (submitted[i]) {
+			bufs[i]->b_dev->d_wait(bufs[i]->b_dev, &reqs[i]);
+			results[i] = reqs[i].dr_result;
+			if (results[i] == 0) {
+				continue;
+			}
+		}
+		/* Not submitted, or failed: do it the slow way. */
+		results[i] = buf_io(bufs[i], UIO_WRITE);
+	}
+
+	lock_acquire(buf_lock);
+	for (i=0; i<count; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_dirty);
+		if (results[i] == 0) {
+			bufs[i]->b_dirty = false;
+			buf_ndirty--;
+		}
+		else {
+			ret = results[i];
+		}
+		bufs[i]->b_busy = false;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+
+	return ret;
+}
+
+static
+void
+buf_syncthread(void *unused1, unsigned long unused2)
+{
+	struct buf *bufs[BUF_SYNCBATCH];
+	struct buf *b;
+	time_t now;
+	uint32_t nsecs;
+	unsigned n, interval;
+	bool pressure;
+
+	(void)unused1;
+	(void)unused2;
+
+	for (;;) {
+		clocksleep(1);
+
+		gettime(&now, &nsecs);
+		interval = buf_syncinterval;
+
+		lock_acquire(buf_lock);
+		pressure = buf_ndirty > buf_max / BUF_DIRTYHIGH;
+		for (;;) {
+			if (pressure && buf_ndirty <= buf_max / BUF_DIRTYLOW) {
+				pressure = false;
+			}
+
+			n = 0;
+			for (b = buf_lruhead; b != NULL && n < BUF_SYNCBATCH;
+			     b = b->b_lrunext) {
+				if (!b->b_dirty || b->b_busy) {
+					continue;
+				}
+				if (!pressure && (interval == 0 ||
+				    now - b->b_dirtytime < (time_t)interval)) {
+					continue;
+				}
+				b->b_busy = true;
+				bufs[n++] = b;
+			}
+			if (n == 0) {
+				break;
+			}
+
+			lock_release(buf_lock);
+			if (buf_writebatch(bufs, n)) {
+				/* Leave it until next time. */
+				lock_acquire(buf_lock);
+				break;
+			}
+			lock_acquire(buf_lock);
+		}
+		lock_release(buf_lock);
+	}
+}
+
+void
+buf_setsyncinterval(unsigned seconds)
+{
+	buf_syncinterval = seconds;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Whole-device operations
+
+/*
+ * Busy buffers of DEV are waited for, since their owners may be about
+ * to dirty them, or the syncer may be writing them and fail. The
+ * caller must not have any of DEV's buffers busy itself. The list can
+ * change while buf_lock is dropped, so we start again from the top
+ * after each wait or write.
+ */
+int
+buf_sync(struct device *dev)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+
+ again:
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		if (!b->b_dirty) {
+			continue;
+		}
+		b->b_busy = true;
+		result = buf_writeback(b);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+		goto again;
+	}
+
+	lock_release(buf_lock);
+	return 0;
+}
+
+int
+buf_invalidate(struct device *dev)
+{
+	struct buf *b, *next;
+	unsigned i, n, slot;
+	int result;
+
+	lock_acquire(buf_lock);
+
+	/* Cancel pending read-ahead and wait out any in progress. */
+	n = buf_racount;
+	buf_racount = 0;
+	for (i=0; i<n; i++) {
+		slot = (buf_rahead + i) % BUF_RAQUEUESIZE;
+		if (buf_raqueue[slot].ra_dev != dev) {
+			buf_raqueue[(buf_rahead + buf_racount)
+				    % BUF_RAQUEUESIZE] = buf_raqueue[slot];
+			buf_racount++;
+		}
+	}
+	while (buf_radev == dev) {
+		cv_wait(buf_cv, buf_lock);
+	}
+
+	/*
+	 * Wait out anyone else still holding a buffer, such as a
+	 * syncer batch, and write back anything left dirty.
+	 */
+ again:
+	for (b = buf_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_dev != dev) {
+			continue;
+		}
+		if (b->b_busy) {
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		if (b->b_dirty) {
+			b->b_busy = true;
+			result = buf_writeback(b);
+			b->b_busy = false;
+			cv_broadcast(buf_cv, buf_lock);
+			if (result) {
+				lock_release(buf_lock);
+				return result;
+			}
+			goto again;
+		}
+		buf_disown(b);
+	}
+	lock_release(buf_lock);
+	return 0;
+}
@@ -0,0 +1,290 @@
+/*
+ * Directory name cache. See <dcache.h>.
+ *
+ * A fixed pool of entries, found through a hash table keyed on
+ * (directory, name) and kept on an LRU list. Entries not in use are
+ * at the least recently used end, so they are taken first.
+ *
+ * dcache_lock protects everything. References the cache gives up are
+ * dropped only after letting go of it, since dropping the last one
+ * calls into the filesystem to reclaim the vnode.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <dcache.h>
+
+#define DCACHE_NENTRIES  256
+#define DCACHE_HASHSIZE  127
+
+struct dcentry {
+	struct dcentry *dc_hashnext;	/* next in hash chain */
+	struct dcentry *dc_lrunext;	/* next more recently used */
+	struct dcentry *dc_lruprev;	/* next less recently used */
+	struct vnode *dc_dir;		/* directory, or NULL if unused */
+	struct vnode *dc_vn;		/* what the name is, or NULL */
+	char dc_name[DCACHE_NAMELEN];
+};
+
+static struct lock *dcache_lock;
+static struct dcentry *dcache_entries;
+static struct dcentry *dcache_hash[DCACHE_HASHSIZE];
+static struct dcentry *dcache_lruhead;	/* least recently used */
+static struct dcentry *dcache_lrutail;	/* most recently used */
+
+static
+unsigned
+dcache_hashslot(struct vnode *dir, const char *name)
+{
+	unsigned h;
+
+	h = (uintptr_t)dir / sizeof(struct vnode);
+	for (; *name != 0; name++) {
+		h = h * 31 + (unsigned char)*name;
+	}
+	return h % DCACHE_HASHSIZE;
+}
+
+static
+struct dcentry *
+dcache_find(struct vnode *dir, const char *name)
+{
+	struct dcentry *e;
+
+	for (e = dcache_hash[dcache_hashslot(dir, name)]; e != NULL;
+	     e = e->dc_hashnext) {
+		if (e->dc_dir == dir && !strcmp(e->dc_name, name)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+dcache_lruremove(struct dcentry *e)
+{
+	if (e->dc_lruprev != NULL) {
+		e->dc_lruprev->dc_lrunext = e->dc_lrunext;
+	}
+	else {
+		dcache_lruhead = e->dc_lrunext;
+	}
+	if (e->dc_lrunext != NULL) {
+		e->dc_lrunext->dc_lruprev = e->dc_lruprev;
+	}
+	else {
+		dcache_lrutail = e->dc_lruprev;
+	}
+	e->dc_lrunext = e->dc_lruprev = NULL;
+}
+
+static
+void
+dcache_lruaddtail(struct dcentry *e)
+{
+	e->dc_lrunext = NULL;
+	e->dc_lruprev = dcache_lrutail;
+	if (dcache_lrutail != NULL) {
+		dcache_lrutail->dc_lrunext = e;
+	}
+	else {
+		dcache_lruhead = e;
+	}
+	dcache_lrutail = e;
+}
+
+static
+void
+dcache_lruaddhead(struct dcentry *e)
+{
+	e->dc_lruprev = NULL;
+	e->dc_lrunext = dcache_lruhead;
+	if (dcache_lruhead != NULL) {
+		dcache_lruhead->dc_lruprev = e;
+	}
+	else {
+		dcache_lrutail = e;
+	}
+	dcache_lruhead = e;
+}
+
+/*
+ * Take an entry out of use. The references it held are handed back
+ * in *DIR and *VN for the caller to drop once it has released
+ * dcache_lock.
+ */
+static
+void
+dcache_clear(struct dcentry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct dcentry **ep;
+
+	KASSERT(lock_do_i_hold(dcache_lock));
+	KASSERT(e->dc_dir != NULL);
+
+	for (ep = &dcache_hash[dcache_hashslot(e->dc_dir, e->dc_name)];
+	     *ep != e; ep = &(*ep)->dc_hashnext) {
+		KASSERT(*ep != NULL);
+	}
+	*ep = e->dc_hashnext;
+	e->dc_hashnext = NULL;
+
+	*dir = e->dc_dir;
+	*vn = e->dc_vn;
+	e->dc_dir = NULL;
+	e->dc_vn = NULL;
+
+	dcache_lruremove(e);
+	dcache_lruaddhead(e);
+}
+
+/*
+ * Drop the references dcache_clear handed back.
+ */
+static
+void
+dcache_putrefs(struct vnode *dir, struct vnode *vn)
+{
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+void
+dcache_bootstrap(void)
+{
+	unsigned i;
+
+	dcache_lock = lock_create("dcache");
+	dcache_entries = kmalloc(DCACHE_NENTRIES * sizeof(struct dcentry));
+	if (dcache_lock == NULL || dcache_entries == NULL) {
+		panic("dcache_bootstrap: Out of memory\n");
+	}
+
+	dcache_lruhead = dcache_lrutail = NULL;
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		dcache_entries[i].dc_hashnext = NULL;
+		dcache_entries[i].dc_dir = NULL;
+		dcache_entries[i].dc_vn = NULL;
+		dcache_entries[i].dc_name[0] = 0;
+		dcache_lruaddtail(&dcache_entries[i]);
+	}
+	for (i=0; i<DCACHE_HASHSIZE; i++) {
+		dcache_hash[i] = NULL;
+	}
+}
+
+bool
+dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret)
+{
+	struct dcentry *e;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return false;
+	}
+
+	lock_acquire(dcache_lock);
+	e = dcache_find(dir, name);
+	if (e == NULL) {
+		lock_release(dcache_lock);
+		return false;
+	}
+	dcache_lruremove(e);
+	dcache_lruaddtail(e);
+	if (e->dc_vn != NULL) {
+		VOP_INCREF(e->dc_vn);
+	}
+	*ret = e->dc_vn;
+	lock_release(dcache_lock);
+
+	return true;
+}
+
+void
+dcache_enter(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct dcentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	KASSERT(dir != NULL);
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+
+	e = dcache_find(dir, name);
+	if (e == NULL) {
+		e = dcache_lruhead;
+		KASSERT(e != NULL);
+	}
+	if (e->dc_dir != NULL) {
+		dcache_clear(e, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->dc_dir = dir;
+	e->dc_vn = vn;
+	strcpy(e->dc_name, name);
+
+	e->dc_hashnext = dcache_hash[dcache_hashslot(dir, name)];
+	dcache_hash[dcache_hashslot(dir, name)] = e;
+	dcache_lruremove(e);
+	dcache_lruaddtail(e);
+
+	lock_release(dcache_lock);
+
+	dcache_putrefs(olddir, oldvn);
+}
+
+void
+dcache_remove(struct vnode *dir, const char *name)
+{
+	struct dcentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	if (strlen(name) >= DCACHE_NAMELEN) {
+		return;
+	}
+
+	lock_acquire(dcache_lock);
+	e = dcache_find(dir, name);
+	if (e != NULL) {
+		dcache_clear(e, &olddir, &oldvn);
+	}
+	lock_release(dcache_lock);
+
+	dcache_putrefs(olddir, oldvn);
+}
+
+void
+dcache_purgefs(struct fs *fs)
+{
+	struct dcentry *e;
+	struct vnode *olddir, *oldvn;
+	unsigned i;
+
+	lock_acquire(dcache_lock);
+	for (i=0; i<DCACHE_NENTRIES; i++) {
+		e = &dcache_entries[i];
+		if (e->dc_dir == NULL || e->dc_dir->vn_fs != fs) {
+			continue;
+		}
+		dcache_clear(e, &olddir, &oldvn);
+
+		lock_release(dcache_lock);
+		dcache_putrefs(olddir, oldvn);
+		lock_acquire(dcache_lock);
+	}
+	lock_release(dcache_lock);
+}
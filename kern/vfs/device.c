@@ -463,3 +463,15 @@ dev_create_vnode(struct device *dev)
 
 	return v;
 }
+
+/*
+ * Function to get back the device from a vnode made by dev_create_vnode.
+ */
+struct device *
+dev_getdevice(struct vnode *v)
+{
+	if (v->vn_ops != &dev_vnode_ops) {
+		return NULL;
+	}
+	return v->vn_data;
+}
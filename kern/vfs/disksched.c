@@ -0,0 +1,351 @@
+/*
+ * Disk request scheduling. See <disksched.h>.
+ *
+ * Pending requests are kept in a single list sorted by starting
+ * block, linked through dr_next. Each entry in the list is the head
+ * of a chain of merged requests (linked through dr_merged) covering
+ * consecutive blocks. A chain is scheduled as a unit, and its
+ * dr_deadline is the earliest of any request in it.
+ *
+ * Deadlines are counted in dispatches rather than in time: a request
+ * arriving when ds_ndispatch is N must be dispatched no later than
+ * dispatch N + DISKSCHED_DEADLINE. Since every chain's deadline is
+ * fixed when its first request arrives, the earliest deadline also
+ * tells the FIFO policy which chain arrived first.
+ *
+ * Each chain also has a sequence number, dr_seq: the arrival number
+ * (ds_nadd) of the oldest request in it. A request that overlaps a
+ * pending chain is never merged, so it starts a chain of its own
+ * with a later dr_seq than every chain it overlaps; disksched_next
+ * never dispatches a chain while an overlapping one with an earlier
+ * dr_seq is pending. That keeps overlapping requests in order no
+ * matter what the policy and deadlines choose.
+ *
+ * The lists are short - a few requests per thread doing I/O - so
+ * everything here is a linear scan.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <device.h>
+#include <disksched.h>
+
+struct disksched_policy {
+	const char *dp_name;
+
+	/* Choose (but don't remove) the next chain to run. */
+	struct devreq *(*dp_choose)(struct disksched *ds);
+};
+
+struct disksched {
+	char *ds_name;
+	const struct disksched_policy *ds_policy;
+	struct disksched *ds_next;	/* on disksched_all */
+
+	struct devreq *ds_queue;	/* pending chains, by block */
+	uint32_t ds_headpos;		/* block after the last one run */
+	unsigned ds_depth;		/* pending requests */
+
+	/* Statistics */
+	unsigned ds_ndispatch;		/* chains dispatched */
+	unsigned ds_nadd;		/* requests added */
+	unsigned ds_nmerged;		/* ...of which merged */
+	unsigned ds_nexpired;		/* chains run for their deadline */
+	unsigned ds_maxdepth;		/* largest ds_depth seen */
+	uint64_t ds_seektotal;		/* sum of blocks moved per dispatch */
+	uint64_t ds_depthtotal;		/* sum of ds_depth at each add */
+};
+
+/* Every scheduler, for disksched_printstats. */
+static struct disksched *disksched_all;
+
+/*
+ * True if deadline A comes before deadline B. The dispatch counter
+ * wraps, so compare the difference.
+ */
+static
+bool
+disksched_before(unsigned a, unsigned b)
+{
+	return (int)(a - b) < 0;
+}
+
+/*
+ * Return the number of blocks in the chain starting at REQ.
+ */
+static
+uint32_t
+disksched_chainblocks(struct devreq *req)
+{
+	uint32_t n = 0;
+
+	for (; req != NULL; req = req->dr_merged) {
+		n += req->dr_nblocks;
+	}
+	return n;
+}
+
+/*
+ * True if the chains starting at A and B share any block.
+ */
+static
+bool
+disksched_overlaps(struct devreq *a, struct devreq *b)
+{
+	return a->dr_block < b->dr_block + disksched_chainblocks(b) &&
+		b->dr_block < a->dr_block + disksched_chainblocks(a);
+}
+
+/*
+ * Return the chain with the earliest deadline.
+ */
+static
+struct devreq *
+disksched_earliest(struct disksched *ds)
+{
+	struct devreq *req, *best;
+
+	best = ds->ds_queue;
+	for (req = best; req != NULL; req = req->dr_next) {
+		if (disksched_before(req->dr_deadline, best->dr_deadline)) {
+			best = req;
+		}
+	}
+	return best;
+}
+
+static
+struct devreq *
+fifo_choose(struct disksched *ds)
+{
+	return disksched_earliest(ds);
+}
+
+static
+struct devreq *
+cscan_choose(struct disksched *ds)
+{
+	struct devreq *req;
+
+	for (req = ds->ds_queue; req != NULL; req = req->dr_next) {
+		if (req->dr_block >= ds->ds_headpos) {
+			return req;
+		}
+	}
+
+	/* Nothing further up; start over from the bottom. */
+	return ds->ds_queue;
+}
+
+const struct disksched_policy disksched_fifo = {
+	.dp_name = "fifo",
+	.dp_choose = fifo_choose,
+};
+
+const struct disksched_policy disksched_cscan = {
+	.dp_name = "cscan",
+	.dp_choose = cscan_choose,
+};
+
+struct disksched *
+disksched_create(const char *name, const struct disksched_policy *policy)
+{
+	struct disksched *ds;
+
+	ds = kmalloc(sizeof(*ds));
+	if (ds == NULL) {
+		return NULL;
+	}
+	ds->ds_name = kstrdup(name);
+	if (ds->ds_name == NULL) {
+		kfree(ds);
+		return NULL;
+	}
+	ds->ds_policy = policy;
+
+	ds->ds_queue = NULL;
+	ds->ds_headpos = 0;
+	ds->ds_depth = 0;
+
+	ds->ds_ndispatch = 0;
+	ds->ds_nadd = 0;
+	ds->ds_nmerged = 0;
+	ds->ds_nexpired = 0;
+	ds->ds_maxdepth = 0;
+	ds->ds_seektotal = 0;
+	ds->ds_depthtotal = 0;
+
+	/* Only done during autoconfiguration, so no locking needed. */
+	ds->ds_next = disksched_all;
+	disksched_all = ds;
+
+	return ds;
+}
+
+void
+disksched_add(struct disksched *ds, struct devreq *req)
+{
+	struct devreq **prevp, *prev, *next, *tail, *r;
+	bool overlap;
+
+	KASSERT(req->dr_nblocks > 0);
+
+	req->dr_next = NULL;
+	req->dr_merged = NULL;
+	req->dr_deadline = ds->ds_ndispatch + DISKSCHED_DEADLINE;
+	req->dr_seq = ds->ds_nadd;
+
+	ds->ds_nadd++;
+	ds->ds_depth++;
+	ds->ds_depthtotal += ds->ds_depth;
+	if (ds->ds_depth > ds->ds_maxdepth) {
+		ds->ds_maxdepth = ds->ds_depth;
+	}
+
+	/*
+	 * If it overlaps anything pending, it stays on its own, so
+	 * disksched_next can keep it behind what it overlaps.
+	 */
+	overlap = false;
+	for (r = ds->ds_queue; r != NULL; r = r->dr_next) {
+		if (disksched_overlaps(r, req)) {
+			overlap = true;
+			break;
+		}
+	}
+
+	/* Find where it goes: after every chain starting at or below it. */
+	prev = NULL;
+	prevp = &ds->ds_queue;
+	while (*prevp != NULL && (*prevp)->dr_block <= req->dr_block) {
+		prev = *prevp;
+		prevp = &prev->dr_next;
+	}
+	next = *prevp;
+
+	if (overlap) {
+		goto insert;
+	}
+
+	/* Does it carry on from the end of the chain before it? */
+	if (prev != NULL && prev->dr_write == req->dr_write) {
+		uint32_t n = disksched_chainblocks(prev);
+
+		if (prev->dr_block + n == req->dr_block &&
+		    n + req->dr_nblocks <= DISKSCHED_MAXMERGE) {
+			for (tail = prev; tail->dr_merged != NULL;
+			     tail = tail->dr_merged) {
+				/* nothing */
+			}
+			tail->dr_merged = req;
+			ds->ds_nmerged++;
+			return;
+		}
+	}
+
+	/* Does the chain after it carry on from its end? */
+	if (next != NULL && next->dr_write == req->dr_write &&
+	    req->dr_block + req->dr_nblocks == next->dr_block &&
+	    req->dr_nblocks + disksched_chainblocks(next)
+	    <= DISKSCHED_MAXMERGE) {
+		/* Take its place, and keep its (earlier) deadline and seq. */
+		req->dr_merged = next;
+		req->dr_next = next->dr_next;
+		req->dr_deadline = next->dr_deadline;
+		req->dr_seq = next->dr_seq;
+		next->dr_next = NULL;
+		*prevp = req;
+		ds->ds_nmerged++;
+		return;
+	}
+
+ insert:
+	req->dr_next = next;
+	*prevp = req;
+}
+
+struct devreq *
+disksched_next(struct disksched *ds)
+{
+	struct devreq **prevp, *req, *r;
+
+	if (ds->ds_queue == NULL) {
+		return NULL;
+	}
+
+	req = disksched_earliest(ds);
+	if (!disksched_before(ds->ds_ndispatch, req->dr_deadline)) {
+		ds->ds_nexpired++;
+	}
+	else {
+		req = ds->ds_policy->dp_choose(ds);
+	}
+
+	/*
+	 * Nothing goes ahead of an older chain it overlaps. Each
+	 * switch goes to an earlier dr_seq, so this ends.
+	 */
+	r = ds->ds_queue;
+	while (r != NULL) {
+		if (disksched_before(r->dr_seq, req->dr_seq) &&
+		    disksched_overlaps(r, req)) {
+			req = r;
+			r = ds->ds_queue;
+		}
+		else {
+			r = r->dr_next;
+		}
+	}
+
+	/* Unlink it. */
+	for (prevp = &ds->ds_queue; *prevp != req;
+	     prevp = &(*prevp)->dr_next) {
+		KASSERT(*prevp != NULL);
+	}
+	*prevp = req->dr_next;
+	req->dr_next = NULL;
+
+	ds->ds_seektotal += req->dr_block >= ds->ds_headpos ?
+		req->dr_block - ds->ds_headpos :
+		ds->ds_headpos - req->dr_block;
+	ds->ds_headpos = req->dr_block + disksched_chainblocks(req);
+	ds->ds_ndispatch++;
+
+	for (r = req; r != NULL; r = r->dr_merged) {
+		KASSERT(ds->ds_depth > 0);
+		ds->ds_depth--;
+	}
+
+	return req;
+}
+
+/*
+ * The counters are read without the drivers' locks, so a disk that is
+ * busy at the time may be reported slightly inconsistently.
+ */
+void
+disksched_printstats(void)
+{
+	struct disksched *ds;
+	unsigned avgseek, avgdepth;
+
+	for (ds = disksched_all; ds != NULL; ds = ds->ds_next) {
+		avgseek = 0;
+		if (ds->ds_ndispatch > 0) {
+			avgseek = ds->ds_seektotal / ds->ds_ndispatch;
+		}
+		avgdepth = 0;
+		if (ds->ds_nadd > 0) {
+			avgdepth = ds->ds_depthtotal * 100 / ds->ds_nadd;
+		}
+
+		kprintf("%s: %s, %u requests, %u merged, %u dispatches "
+			"(%u past deadline)\n",
+			ds->ds_name, ds->ds_policy->dp_name, ds->ds_nadd,
+			ds->ds_nmerged, ds->ds_ndispatch, ds->ds_nexpired);
+		kprintf("%s: average seek %u blocks, queue depth "
+			"%u.%02u average, %u max, %u now\n",
+			ds->ds_name, avgseek, avgdepth / 100, avgdepth % 100,
+			ds->ds_maxdepth, ds->ds_depth);
+	}
+}
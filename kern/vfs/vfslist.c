@@ -43,6 +43,8 @@
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <dcache.h>
 
 /*
  * Structure for a single named device.
@@ -109,6 +111,9 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	buf_bootstrap();
+	dcache_bootstrap();
+
 	devnull_create();
 }
 
@@ -571,6 +576,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* Let go of the vnodes the name cache is holding. */
+	dcache_purgefs(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -619,6 +627,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		dcache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -48,6 +48,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	KASSERT(vn!=NULL);
 	KASSERT(ops!=NULL);
 
+	spinlock_init(&vn->vn_countlock);
 	vn->vn_ops = ops;
 	vn->vn_refcount = 1;
 	vn->vn_opencount = 0;
@@ -71,6 +72,7 @@ vnode_cleanup(struct vnode *vn)
 	vn->vn_opencount = 0;
 	vn->vn_fs = NULL;
 	vn->vn_data = NULL;
+	spinlock_cleanup(&vn->vn_countlock);
 }
 
 
@@ -83,32 +85,38 @@ vnode_incref(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_refcount++;
-
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
  * Decrement refcount.
  * Called by VOP_DECREF.
- * Calls VOP_RECLAIM if the refcount hits zero.
+ * Calls VOP_RECLAIM if the refcount hits zero. The last reference
+ * isn't dropped here but handed to VOP_RECLAIM, which decides under
+ * the filesystem's own locks whether the vnode is really unused.
  */
 void
 vnode_decref(struct vnode *vn)
 {
+	bool reclaim;
 	int result;
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
-
+	spinlock_acquire(&vn->vn_countlock);
 	KASSERT(vn->vn_refcount>0);
 	if (vn->vn_refcount>1) {
 		vn->vn_refcount--;
+		reclaim = false;
 	}
 	else {
+		reclaim = true;
+	}
+	spinlock_release(&vn->vn_countlock);
+
+	if (reclaim) {
 		result = VOP_RECLAIM(vn);
 		if (result != 0 && result != EBUSY) {
 			// XXX: lame.
@@ -116,8 +124,6 @@ vnode_decref(struct vnode *vn)
 				strerror(result));
 		}
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -129,9 +135,9 @@ vnode_incopen(struct vnode *vn)
 {
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 	vn->vn_opencount++;
-	vfs_biglock_release();
+	spinlock_release(&vn->vn_countlock);
 }
 
 /*
@@ -145,16 +151,18 @@ vnode_decopen(struct vnode *vn)
 
 	KASSERT(vn != NULL);
 
-	vfs_biglock_acquire();
+	spinlock_acquire(&vn->vn_countlock);
 
 	KASSERT(vn->vn_opencount>0);
 	vn->vn_opencount--;
 
 	if (vn->vn_opencount > 0) {
-		vfs_biglock_release();
+		spinlock_release(&vn->vn_countlock);
 		return;
 	}
 
+	spinlock_release(&vn->vn_countlock);
+
 	result = VOP_CLOSE(vn);
 	if (result) {
 		// XXX: also lame.
@@ -162,8 +170,6 @@ vnode_decopen(struct vnode *vn)
 		// doesn't get reached...
 		kprintf("vfs: Warning: VOP_CLOSE: %s\n", strerror(result));
 	}
-
-	vfs_biglock_release();
 }
 
 /*
@@ -173,8 +179,6 @@ vnode_decopen(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
-
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -194,6 +198,8 @@ vnode_check(struct vnode *v, const char *opstr)
 		      opstr, v->vn_ops->vop_magic);
 	}
 
+	spinlock_acquire(&v->vn_countlock);
+
 	// Device vnodes have null fs pointers.
 	//if (v->vn_fs == NULL) {
 	//	panic("vnode_check: vop_%s: null fs pointer\n", opstr);
@@ -223,5 +229,5 @@ vnode_check(struct vnode *v, const char *opstr)
 			opstr, v->vn_opencount);
 	}
 
-	vfs_biglock_release();
+	spinlock_release(&v->vn_countlock);
 }
@@ -0,0 +1,380 @@
+/*
+ * Address spaces for the paged VM system.
+ *
+ * An address space is a handful of regions (one per ELF segment plus
+ * the stack) and a page table. Nothing is allocated up front: frames
+ * are obtained one at a time from the coremap when vm_fault() first
+ * sees a page, and returned when the address space is destroyed.
+ *
+ * Nothing is read from the executable up front either. load_elf only
+ * records where each segment lives in the file; as_loadpage reads a
+ * page's worth when it is first touched, so exec cost depends on how
+ * much of the program runs rather than on how big it is.
+ *
+ * When memory is short the coremap evicts pages through
+ * as_evictpage. Pages of read-only segments are simply dropped and
+ * reread from the executable if needed again; anything else goes to
+ * swap and its page table entry records the slot.
+ *
+ * as_activate and as_deactivate deal with the TLB and live with the
+ * rest of the machine-dependent code in arch/mips/vm/vm.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <uw-vmstats.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <coremap.h>
+#include <swap.h>
+#include <vm.h>
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_nregions = 0;
+	as->as_file = NULL;
+
+	return as;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct pagetable *pt;
+	pte_t *table;
+	unsigned d, i;
+
+	KASSERT(as != NULL);
+
+	pt = as->as_pt;
+	for (d=0; d<PT_NDIRS; d++) {
+		table = pt->pt_dir[d];
+		if (table == NULL) {
+			continue;
+		}
+		for (i=0; i<PT_NENTRIES; i++) {
+			if (pt_pin(&table[i])) {
+				coremap_release(PTE_FRAME(table[i]), as);
+			}
+			else if (table[i] & PTE_SWAPPED) {
+				swap_free(PTE_SWAPSLOT(table[i]));
+			}
+		}
+	}
+	pt_destroy(pt);
+
+	if (as->as_file != NULL) {
+		vfs_close(as->as_file);
+	}
+	kfree(as);
+}
+
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i;
+
+	for (i=0; i<as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
+	}
+	return NULL;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	struct region *rg;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	/* The MIPS TLB can't make a page writeable but unreadable, etc. */
+	(void)readable;
+	(void)executable;
+
+	if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+		return EFAULT;
+	}
+	if (as->as_nregions == AS_MAXREGIONS) {
+		kprintf("vm: Warning: too many regions\n");
+		return EUNIMP;
+	}
+
+	rg = &as->as_regions[as->as_nregions++];
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = sz / PAGE_SIZE;
+	rg->rg_writeable = writeable != 0;
+	rg->rg_filevaddr = vaddr;
+	rg->rg_fileoff = 0;
+	rg->rg_filesize = 0;
+
+	return 0;
+}
+
+int
+as_define_file(struct addrspace *as, struct vnode *v,
+	       off_t offset, vaddr_t vaddr, size_t filesize)
+{
+	struct region *rg;
+
+	rg = as_findregion(as, vaddr);
+	if (rg == NULL ||
+	    vaddr + filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		return ENOEXEC;
+	}
+
+	KASSERT(as->as_file == NULL || as->as_file == v);
+	if (as->as_file == NULL) {
+		/* Hold the file open for as long as we may page from it. */
+		VOP_INCOPEN(v);
+		VOP_INCREF(v);
+		as->as_file = v;
+	}
+
+	rg->rg_filevaddr = vaddr;
+	rg->rg_fileoff = offset;
+	rg->rg_filesize = filesize;
+	return 0;
+}
+
+int
+as_loadpage(struct addrspace *as, struct region *rg,
+	    vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t start, end;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	/* Intersect the page with the file-backed part of the region. */
+	start = vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (start < rg->rg_filevaddr) {
+		start = rg->rg_filevaddr;
+	}
+	if (end > rg->rg_filevaddr + rg->rg_filesize) {
+		end = rg->rg_filevaddr + rg->rg_filesize;
+	}
+
+	if (start >= end) {
+		/* bss, stack, or past the end of the file data */
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	KASSERT(as->as_file != NULL);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr + (start - vaddr)),
+		  end - start, rg->rg_fileoff + (start - rg->rg_filevaddr),
+		  UIO_READ);
+	result = VOP_READ(as->as_file, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		kprintf("vm: short read on executable - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+	return 0;
+}
+
+int
+as_evictpage(struct addrspace *as, vaddr_t vaddr, paddr_t paddr)
+{
+	struct region *rg;
+	pte_t *pte;
+	unsigned slot;
+	int result;
+
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	KASSERT(pte != NULL);
+	/* Still marked copy-on-write if the other sharers have gone. */
+	KASSERT((*pte & ~(pte_t)PTE_COW) == PTE_MAKE(paddr, PTE_VALID));
+
+	rg = as_findregion(as, vaddr);
+	KASSERT(rg != NULL);
+
+	if (!rg->rg_writeable) {
+		/* Never modified; as_loadpage can recreate it. */
+		vm_tlbshootdown_vaddr(vaddr);
+		*pte = 0;
+		return 0;
+	}
+
+	result = swap_alloc(&slot);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Revoke the translations before copying the page out, so
+	 * the copy can't miss a late write. The owner faulting on it
+	 * meanwhile waits in pt_pin for us to finish.
+	 */
+	vm_tlbshootdown_vaddr(vaddr);
+
+	result = swap_out(paddr, slot);
+	if (result) {
+		swap_free(slot);
+		return result;
+	}
+
+	*pte = PTE_MAKESWAP(slot);
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to do: segments are paged in as they're touched. */
+	(void)as;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	(void)as;
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	result = as_define_region(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+				  VM_STACKPAGES * PAGE_SIZE, 1, 1, 0);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+/*
+ * Copy an address space for fork. No page contents are copied: every
+ * resident frame is shared between OLD and the copy, with both
+ * mappings marked copy-on-write, and vm_fault makes a private copy
+ * for whichever process writes to the page first.
+ *
+ * Pages of OLD that are out in swap can't be shared this way, so the
+ * copy gets its own resident copy of each of those.
+ *
+ * OLD must be the current address space, since its TLB entries are
+ * flushed to revoke write access to the now-shared frames.
+ */
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct region *rg;
+	pte_t *table, *npte;
+	vaddr_t vaddr;
+	paddr_t paddr;
+	unsigned d, i;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+
+	for (i=0; i<old->as_nregions; i++) {
+		new->as_regions[i] = old->as_regions[i];
+	}
+	new->as_nregions = old->as_nregions;
+
+	if (old->as_file != NULL) {
+		VOP_INCOPEN(old->as_file);
+		VOP_INCREF(old->as_file);
+		new->as_file = old->as_file;
+	}
+
+	for (d=0; d<PT_NDIRS; d++) {
+		table = old->as_pt->pt_dir[d];
+		if (table == NULL) {
+			continue;
+		}
+		for (i=0; i<PT_NENTRIES; i++) {
+			if ((table[i] & (PTE_VALID | PTE_SWAPPED)) == 0) {
+				continue;
+			}
+
+			vaddr = PT_VADDR(d, i);
+			npte = pt_lookup(new->as_pt, vaddr, true);
+			if (npte == NULL) {
+				result = ENOMEM;
+				goto fail;
+			}
+
+			if (pt_pin(&table[i])) {
+				/* Read-only pages can simply be shared. */
+				rg = as_findregion(old, vaddr);
+				if (rg != NULL && rg->rg_writeable) {
+					table[i] |= PTE_COW;
+				}
+				coremap_incref(PTE_FRAME(table[i]), new);
+				*npte = table[i];
+				coremap_unpin(PTE_FRAME(table[i]));
+			}
+			else if (table[i] & PTE_SWAPPED) {
+				paddr = coremap_alloc_upage(new, vaddr);
+				if (paddr == 0) {
+					result = ENOMEM;
+					goto fail;
+				}
+				result = swap_in(PTE_SWAPSLOT(table[i]), paddr);
+				if (result) {
+					coremap_free(paddr);
+					goto fail;
+				}
+				*npte = PTE_MAKE(paddr, PTE_VALID);
+				coremap_unpin(paddr);
+			}
+		}
+	}
+
+	as_activate();
+
+	*ret = new;
+	return 0;
+
+ fail:
+	as_destroy(new);
+	as_activate();
+	return result;
+}
@@ -0,0 +1,635 @@
+/*
+ * Physical frame table (coremap). See coremap.h.
+ *
+ * The coremap itself lives at the bottom of the memory handed over by
+ * ram_getsize(); the frames it describes start on the first page
+ * boundary after it. Each entry records whether the frame is in use
+ * and, for the first frame of an allocation, how many frames the
+ * allocation spans so that free_kpages() can release the whole run
+ * given only its address.
+ *
+ * User frames are reference counted so that fork can share them
+ * copy-on-write between parent and child; a frame goes back on the
+ * free list when its last mapping releases it. A user frame with a
+ * single mapping also records which page of which address space maps
+ * it, which is what the evictor needs to find the page table entry.
+ * Shared frames are never evicted.
+ *
+ * A frame shared by two mappings remembers both in cme_as and
+ * cme_as2. Fork shares a page at the same address in the parent and
+ * the child, so cme_vaddr does for both. When one of them lets go
+ * the other owns the frame again, and it can be evicted. If there are
+ * more than two we lose track. The last one left then takes the
+ * frame back when it next faults on it (see vm_fault).
+ *
+ * Evictions are serialized by cm_evictlock; there is only one disk to
+ * write them to anyway.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+
+#define KVADDR_TO_PADDR(vaddr) ((vaddr)-MIPS_KSEG0)
+
+/*
+ * The paging daemon is woken when fewer than 1/CM_LOWATER_DIV of the
+ * frames are free and evicts until twice that many are.
+ */
+#define CM_LOWATER_DIV	32
+#define CM_LOWATER_MIN	2
+
+struct coremap_entry {
+	unsigned cme_npages;	/* length of allocation starting here, or 0 */
+	unsigned cme_refcount;	/* mappings of a user frame */
+	struct addrspace *cme_as;  /* sole mapping of a user frame, or NULL */
+	struct addrspace *cme_as2; /* other mapping if exactly two, or NULL */
+	vaddr_t cme_vaddr;	/* ...and the page it is mapped at */
+	bool cme_used;		/* frame is allocated */
+	bool cme_kernel;	/* frame belongs to the kernel heap */
+	bool cme_busy;		/* user frame is pinned */
+	bool cme_referenced;	/* used since the clock hand last passed */
+};
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;
+static paddr_t cm_base;		/* physical address of frame 0 */
+static unsigned cm_npages;	/* number of frames managed */
+static unsigned cm_nfree;	/* number of those that are free */
+static unsigned cm_hint;	/* where to start the next search */
+static bool cm_ready;		/* set once coremap_bootstrap is done */
+
+static struct wchan *cm_pinwchan;	/* waiting for a pinned frame */
+static struct lock *cm_evictlock;	/* held while evicting */
+static unsigned cm_clockhand;		/* next frame to consider evicting */
+
+static struct wchan *cm_daemonwchan;	/* paging daemon sleeps here */
+static unsigned cm_lowater, cm_hiwater;	/* daemon thresholds */
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	size_t cmsize;
+	unsigned i;
+
+	ram_getsize(&lo, &hi);
+	KASSERT((lo & PAGE_FRAME) == lo);
+
+	/*
+	 * Size the map for every page in [lo, hi); the pages that end
+	 * up holding the map itself are simply never handed out.
+	 */
+	cm_npages = (hi - lo) / PAGE_SIZE;
+	cmsize = cm_npages * sizeof(struct coremap_entry);
+	cmsize = (cmsize + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	cm_base = lo + cmsize;
+	cm_npages = (hi - cm_base) / PAGE_SIZE;
+
+	for (i=0; i<cm_npages; i++) {
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_as2 = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_used = false;
+		coremap[i].cme_kernel = false;
+		coremap[i].cme_busy = false;
+		coremap[i].cme_referenced = false;
+	}
+	cm_nfree = cm_npages;
+	cm_hint = 0;
+	cm_clockhand = 0;
+
+	spinlock_acquire(&coremap_lock);
+	cm_ready = true;
+	spinlock_release(&coremap_lock);
+
+	/* kmalloc works from here on */
+	cm_pinwchan = wchan_create("coremap");
+	cm_evictlock = lock_create("evict");
+	if (cm_pinwchan == NULL || cm_evictlock == NULL) {
+		panic("coremap_bootstrap: Out of memory\n");
+	}
+
+	kprintf("coremap: %u frames (%uk) at 0x%x\n",
+		cm_npages, cm_npages * PAGE_SIZE / 1024, cm_base);
+}
+
+/*
+ * Look for NPAGES consecutive free frames wholly inside [FROM, TO).
+ * Returns the index of the first one, or -1.
+ */
+static
+int
+coremap_findrun(unsigned from, unsigned to, unsigned long npages)
+{
+	unsigned i, run;
+
+	run = 0;
+	for (i = from; i < to; i++) {
+		if (coremap[i].cme_used) {
+			run = 0;
+		}
+		else if (++run == npages) {
+			return i + 1 - npages;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Find and claim NPAGES contiguous free frames. Searches circularly
+ * from cm_hint so that single-page allocations don't keep rescanning
+ * the busy low end of memory. Returns the index of the first frame,
+ * or -1.
+ */
+static
+int
+coremap_claim(unsigned long npages, bool kernel)
+{
+	unsigned end, i;
+	int start;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if (npages == 0 || npages > cm_nfree) {
+		return -1;
+	}
+
+	start = coremap_findrun(cm_hint, cm_npages, npages);
+	if (start < 0) {
+		/* runs cannot wrap past the end of memory; rescan the front */
+		end = cm_hint + npages - 1;
+		start = coremap_findrun(0, end < cm_npages ? end : cm_npages,
+					npages);
+		if (start < 0) {
+			return -1;
+		}
+	}
+
+	for (i = start; i < start + npages; i++) {
+		coremap[i].cme_used = true;
+		coremap[i].cme_kernel = kernel;
+		coremap[i].cme_npages = 0;
+	}
+	coremap[start].cme_npages = npages;
+	coremap[start].cme_refcount = 1;
+	cm_nfree -= npages;
+	cm_hint = (start + npages) % cm_npages;
+
+	if (cm_nfree < cm_lowater && cm_daemonwchan != NULL) {
+		wchan_wakeone(cm_daemonwchan);
+	}
+
+	return start;
+}
+
+/*
+ * Advance the clock hand to the next user frame that can be evicted,
+ * and pin it. A frame used since the hand last passed has its
+ * reference bit cleared and is skipped this time around. Returns the
+ * frame's index, or -1 if two full sweeps turn up nothing.
+ */
+static
+int
+coremap_pickvictim(void)
+{
+	struct coremap_entry *cme;
+	unsigned n, i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (n=0; n < 2 * cm_npages; n++) {
+		i = cm_clockhand;
+		cm_clockhand = (i + 1) % cm_npages;
+
+		cme = &coremap[i];
+		if (!cme->cme_used || cme->cme_kernel || cme->cme_busy ||
+		    cme->cme_refcount != 1 || cme->cme_as == NULL) {
+			continue;
+		}
+		if (cme->cme_referenced) {
+			/* second chance */
+			cme->cme_referenced = false;
+			continue;
+		}
+		cme->cme_busy = true;
+		return i;
+	}
+	return -1;
+}
+
+/*
+ * Evict one user page. Returns true if a frame was freed.
+ */
+static
+bool
+coremap_evict(void)
+{
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t pa;
+	unsigned tries;
+	int index, result;
+
+	lock_acquire(cm_evictlock);
+	for (tries = 0; tries < cm_npages; tries++) {
+		spinlock_acquire(&coremap_lock);
+		index = coremap_pickvictim();
+		if (index < 0) {
+			spinlock_release(&coremap_lock);
+			break;
+		}
+		as = coremap[index].cme_as;
+		vaddr = coremap[index].cme_vaddr;
+		spinlock_release(&coremap_lock);
+
+		pa = cm_base + index * PAGE_SIZE;
+		result = as_evictpage(as, vaddr, pa);
+		if (result == 0) {
+			coremap_free(pa);
+			lock_release(cm_evictlock);
+			return true;
+		}
+		/* Can't be written out (no swap space?); try another. */
+		coremap_unpin(pa);
+	}
+	lock_release(cm_evictlock);
+	return false;
+}
+
+/*
+ * Whether the current thread may evict a page to satisfy an
+ * allocation: eviction sleeps, so not from an interrupt handler or
+ * with a spinlock held, and not from inside another eviction.
+ */
+static
+bool
+coremap_canevict(void)
+{
+	return cm_evictlock != NULL &&
+		!curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0 &&
+		!lock_do_i_hold(cm_evictlock);
+}
+
+static
+void
+coremap_pagedaemon(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	for (;;) {
+		while (cm_nfree < cm_hiwater) {
+			if (!coremap_evict()) {
+				break;
+			}
+		}
+
+		spinlock_acquire(&coremap_lock);
+		wchan_lock(cm_daemonwchan);
+		spinlock_release(&coremap_lock);
+		wchan_sleep(cm_daemonwchan);
+	}
+}
+
+void
+coremap_startdaemon(void)
+{
+	struct wchan *wc;
+	int result;
+
+	KASSERT(cm_ready);
+
+	wc = wchan_create("pagedaemon");
+	if (wc == NULL) {
+		panic("coremap_startdaemon: Out of memory\n");
+	}
+
+	result = thread_fork("pagedaemon", NULL, coremap_pagedaemon, NULL, 0);
+	if (result) {
+		panic("coremap_startdaemon: thread_fork: %s\n",
+		      strerror(result));
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_lowater = cm_npages / CM_LOWATER_DIV;
+	if (cm_lowater < CM_LOWATER_MIN) {
+		cm_lowater = CM_LOWATER_MIN;
+	}
+	cm_hiwater = 2 * cm_lowater;
+	cm_daemonwchan = wc;
+	spinlock_release(&coremap_lock);
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	paddr_t pa;
+	int index;
+
+	for (;;) {
+		spinlock_acquire(&coremap_lock);
+		if (!cm_ready) {
+			/* Too early; take memory that will never be given back. */
+			pa = ram_stealmem(npages);
+			spinlock_release(&coremap_lock);
+			return pa;
+		}
+		index = coremap_claim(npages, true);
+		spinlock_release(&coremap_lock);
+
+		if (index >= 0) {
+			return cm_base + index * PAGE_SIZE;
+		}
+
+		/*
+		 * Evicting frees frames in clock order, not contiguous
+		 * runs, so only single pages are worth evicting for.
+		 */
+		if (npages != 1 || !coremap_canevict() || !coremap_evict()) {
+			return 0;
+		}
+	}
+}
+
+paddr_t
+coremap_alloc_upage(struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t pa;
+	int index;
+
+	KASSERT(cm_ready);
+	KASSERT(as != NULL);
+
+	for (;;) {
+		spinlock_acquire(&coremap_lock);
+		index = coremap_claim(1, false);
+		if (index >= 0) {
+			coremap[index].cme_as = as;
+			coremap[index].cme_as2 = NULL;
+			coremap[index].cme_vaddr = vaddr;
+			coremap[index].cme_busy = true;
+			coremap[index].cme_referenced = true;
+		}
+		spinlock_release(&coremap_lock);
+
+		if (index >= 0) {
+			break;
+		}
+		if (!coremap_canevict() || !coremap_evict()) {
+			return 0;
+		}
+	}
+
+	pa = cm_base + index * PAGE_SIZE;
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	return pa;
+}
+
+/*
+ * Map a physical address to its coremap index.
+ */
+static
+unsigned
+coremap_index(paddr_t paddr)
+{
+	unsigned index;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(paddr >= cm_base);
+
+	index = (paddr - cm_base) / PAGE_SIZE;
+	KASSERT(index < cm_npages);
+	return index;
+}
+
+bool
+coremap_pin(paddr_t paddr)
+{
+	unsigned index;
+
+	index = coremap_index(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	while (coremap[index].cme_busy) {
+		wchan_lock(cm_pinwchan);
+		spinlock_release(&coremap_lock);
+		wchan_sleep(cm_pinwchan);
+		spinlock_acquire(&coremap_lock);
+	}
+	if (!coremap[index].cme_used || coremap[index].cme_kernel) {
+		spinlock_release(&coremap_lock);
+		return false;
+	}
+	coremap[index].cme_busy = true;
+	spinlock_release(&coremap_lock);
+	return true;
+}
+
+void
+coremap_unpin(paddr_t paddr)
+{
+	unsigned index;
+
+	index = coremap_index(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].cme_used && !coremap[index].cme_kernel);
+	KASSERT(coremap[index].cme_busy);
+	coremap[index].cme_busy = false;
+	coremap[index].cme_referenced = true;
+	wchan_wakeall(cm_pinwchan);
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setowner(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned index;
+
+	index = coremap_index(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].cme_used && !coremap[index].cme_kernel);
+	KASSERT(coremap[index].cme_busy);
+	KASSERT(coremap[index].cme_refcount == 1);
+	coremap[index].cme_as = as;
+	coremap[index].cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_adopt(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[coremap_index(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_used && !cme->cme_kernel);
+	KASSERT(cme->cme_busy);
+	if (cme->cme_refcount == 1 && cme->cme_as == NULL) {
+		cme->cme_as = as;
+		cme->cme_vaddr = vaddr;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_incref(paddr_t paddr, struct addrspace *as)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[coremap_index(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_used && !cme->cme_kernel);
+	KASSERT(cme->cme_busy);
+	KASSERT(cme->cme_refcount > 0);
+	/* shared now, so not evictable, but remember who by if we can */
+	if (cme->cme_refcount == 1 && cme->cme_as != NULL) {
+		cme->cme_as2 = as;
+	}
+	else {
+		cme->cme_as = NULL;
+		cme->cme_as2 = NULL;
+	}
+	cme->cme_refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_release(paddr_t paddr, struct addrspace *as)
+{
+	struct coremap_entry *cme;
+
+	cme = &coremap[coremap_index(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(cme->cme_used && !cme->cme_kernel);
+	KASSERT(cme->cme_busy);
+	KASSERT(cme->cme_refcount > 0);
+	if (cme->cme_refcount == 1) {
+		spinlock_release(&coremap_lock);
+		coremap_free(paddr);
+		return;
+	}
+
+	if (cme->cme_refcount == 2 && cme->cme_as != NULL) {
+		/* The other mapping is the only one left; it owns it. */
+		if (cme->cme_as == as) {
+			cme->cme_as = cme->cme_as2;
+		}
+		else {
+			KASSERT(cme->cme_as2 == as);
+		}
+	}
+	else {
+		cme->cme_as = NULL;
+	}
+	cme->cme_as2 = NULL;
+	cme->cme_refcount--;
+	cme->cme_busy = false;
+	wchan_wakeall(cm_pinwchan);
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned index, refcount;
+
+	index = coremap_index(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].cme_used);
+	refcount = coremap[index].cme_refcount;
+	spinlock_release(&coremap_lock);
+	return refcount;
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	unsigned index, npages, i;
+	bool user;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (paddr < cm_base) {
+		/* Stolen before the coremap existed; leak it. */
+		return;
+	}
+
+	index = coremap_index(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	npages = coremap[index].cme_npages;
+	KASSERT(coremap[index].cme_used);
+	KASSERT(npages > 0);
+	KASSERT(coremap[index].cme_refcount > 0);
+	user = !coremap[index].cme_kernel;
+	KASSERT(!user || coremap[index].cme_busy);
+	if (--coremap[index].cme_refcount > 0) {
+		/*
+		 * Still shared copy-on-write. We don't know which of
+		 * the remaining mappings this was, so nobody owns it.
+		 */
+		coremap[index].cme_as = NULL;
+		coremap[index].cme_as2 = NULL;
+		coremap[index].cme_busy = false;
+		wchan_wakeall(cm_pinwchan);
+		spinlock_release(&coremap_lock);
+		return;
+	}
+	for (i = index; i < index + npages; i++) {
+		KASSERT(coremap[i].cme_used);
+		coremap[i].cme_used = false;
+		coremap[i].cme_kernel = false;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_as2 = NULL;
+		coremap[i].cme_busy = false;
+		coremap[i].cme_referenced = false;
+	}
+	cm_nfree += npages;
+	if (user) {
+		/* anyone waiting will find it free and look again */
+		wchan_wakeall(cm_pinwchan);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	pa = coremap_alloc(npages);
+	if (pa == 0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
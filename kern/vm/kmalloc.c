@@ -29,7 +29,11 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <platform/maxcpus.h>
 #include <vm.h>
 
 /*
@@ -51,15 +55,15 @@ fill_deadbeef(void *vptr, size_t len)
 
 ////////////////////////////////////////////////////////////
 //
-// Pool-based subpage allocator.
+// Slab-based subpage allocator.
 //
 // It works like this:
 //
-//    We allocate one page at a time and fill it with objects of size k,
-//    for various k. Each page has its own freelist, maintained by a
-//    linked list in the first word of each object. Each page also has a
-//    freecount, so we know when the page is completely free and can 
-//    release it.
+//    We allocate one page at a time (a slab) and fill it with objects
+//    of size k, for various k. Each slab has its own freelist,
+//    maintained by a linked list in the first word of each object.
+//    Each slab also has a freecount, so we know when the slab is
+//    completely free and can release it.
 //
 //    No assumptions are made about the sizes k; they need not be
 //    powers of two. Note, however, that malloc must always return
@@ -70,10 +74,24 @@ fill_deadbeef(void *vptr, size_t len)
 //    more blocks would fit on a page than with the existing block
 //    sizes, and large numbers of items of the new size are allocated.
 //
-//    The free counts and addresses of the pages are maintained in
-//    another list.  Maintaining this table is a nuisance, because it
-//    cannot recursively use the subpage allocator. (We could probably
-//    make that work, but it would be painful.)
+//    Each size class keeps its slabs on three lists: partial (some
+//    blocks free), full (none free) and empty (all free). Allocation
+//    takes from the first partial slab, so it never has to search.
+//    A few empty slabs are kept around rather than handed straight
+//    back to the VM system, so that a size class hovering around a
+//    page boundary doesn't allocate and free a page every time.
+//
+//    The descriptor (pageref) for a slab is found from the address of
+//    the page by table lookup rather than by searching, which makes
+//    kfree constant time. The pagerefs live in a two-level table
+//    indexed by physical page number; the second-level tables are a
+//    page each and are allocated when a slab is first created in the
+//    part of memory they cover. This cannot recursively use the
+//    subpage allocator, but it doesn't need to.
+//
+//    Each size class has its own lock, so allocations of different
+//    sizes don't contend. Most allocations don't take it at all but
+//    are served from a per-CPU cache; see "magazines" below.
 //
 
 #undef  SLOW	/* consistency checks */
@@ -95,6 +113,12 @@ static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 #error "Odd page size"
 #endif
 
+/* Empty slabs each size class holds on to. */
+#define MAXEMPTY 1
+
+/* Most free blocks of one size a cpu can hold on to. */
+#define MAGSIZE 16
+
 ////////////////////////////////////////
 
 struct freelist {
@@ -102,9 +126,9 @@ struct freelist {
 };
 
 struct pageref {
-	struct pageref *next_samesize;
-	struct pageref *next_all;
-	vaddr_t pageaddr_and_blocktype;
+	struct pageref *next;		/* on its size class's list */
+	struct pageref *prev;
+	vaddr_t pageaddr_and_blocktype;	/* 0 if the page isn't a slab */
 	uint16_t freelist_offset;
 	uint16_t nfree;
 };
@@ -115,87 +139,175 @@ struct pageref {
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
 
+#define PR_NBLOCKS(blktype) (PAGE_SIZE / sizes[blktype])
+
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * The pageref table. All kernel heap pages are in KSEG0, so a page's
+ * index in the table is its offset into KSEG0 in pages. One page of
+ * pagerefs covers PR_LEAFPAGES pages of memory.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PR_LEAFPAGES	(PAGE_SIZE / sizeof(struct pageref))
+#define PR_KSEG0PAGES	((MIPS_KSEG1 - MIPS_KSEG0) / PAGE_SIZE)
+#define PR_NLEAVES	(PR_KSEG0PAGES / PR_LEAFPAGES)
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *pr_leaves[PR_NLEAVES];
+static struct spinlock pr_leaflock = SPINLOCK_INITIALIZER;
 
+/*
+ * Return the pageref for the page containing ADDR, or NULL if no slab
+ * was ever made in that part of memory.
+ */
 static
 struct pageref *
-allocpageref(void)
+pageref_lookup(vaddr_t addr)
 {
-	unsigned i,j;
-	uint32_t k;
+	unsigned pageno;
+	struct pageref *leaf;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	pageno = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	leaf = pr_leaves[pageno / PR_LEAFPAGES];
+	if (leaf == NULL) {
+		return NULL;
 	}
-
-	/* ran out */
-	return NULL;
+	return &leaf[pageno % PR_LEAFPAGES];
 }
 
+/*
+ * Like pageref_lookup, but creates the second-level table if needed.
+ * Must be called without holding any of the kmalloc locks, since it
+ * may need to allocate.
+ */
 static
-void
-freepageref(struct pageref *p)
+struct pageref *
+pageref_get(vaddr_t addr)
 {
-	size_t i, j;
-	uint32_t k;
-
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	unsigned pageno, i;
+	struct pageref *leaf;
+	vaddr_t newleaf;
+
+	pageno = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	i = pageno / PR_LEAFPAGES;
+	if (pr_leaves[i] == NULL) {
+		newleaf = alloc_kpages(1);
+		if (newleaf == 0) {
+			return NULL;
+		}
+		bzero((void *)newleaf, PAGE_SIZE);
+
+		spinlock_acquire(&pr_leaflock);
+		if (pr_leaves[i] == NULL) {
+			pr_leaves[i] = (struct pageref *)newleaf;
+			newleaf = 0;
+		}
+		spinlock_release(&pr_leaflock);
+
+		if (newleaf != 0) {
+			/* lost a race; somebody else made it */
+			free_kpages(newleaf);
+		}
+	}
+	leaf = pr_leaves[i];
+	return &leaf[pageno % PR_LEAFPAGES];
 }
 
 ////////////////////////////////////////
 
-static struct pageref *sizebases[NSIZES];
-static struct pageref *allbase;
+/*
+ * A size class: its lock and its lists of slabs.
+ */
+struct sizeclass {
+	struct spinlock sc_lock;
+	struct pageref *sc_partial;
+	struct pageref *sc_full;
+	struct pageref *sc_empty;
+	unsigned sc_nempty;
+};
+
+static struct sizeclass sizeclasses[NSIZES] = {
+#define SC_INIT { SPINLOCK_INITIALIZER, NULL, NULL, NULL, 0 }
+	SC_INIT, SC_INIT, SC_INIT, SC_INIT,
+	SC_INIT, SC_INIT, SC_INIT, SC_INIT,
+#undef SC_INIT
+};
 
 ////////////////////////////////////////
+//
+// Per-CPU magazines.
+//
+//    In front of the slab lists, each CPU keeps a small stack (a
+//    magazine) of free blocks of each size. kmalloc and kfree work on
+//    the current CPU's magazine with interrupts off and take no lock
+//    at all; they only go to the slab lists, under the size class
+//    lock, to refill an empty magazine or drain a full one. That is
+//    done half a magazine at a time, so a CPU that alternates
+//    allocating and freeing doesn't bounce between the two.
+//
+//    Blocks sitting in a magazine still count as allocated as far as
+//    their slab is concerned, so a slab with cached blocks is never
+//    released. Magazines for the bigger sizes are kept short to limit
+//    how much memory can be stranded this way.
+//
+
+static struct magazine {
+	unsigned mag_nblocks;
+	void *mag_blocks[MAGSIZE];
+} magazines[MAXCPUS][NSIZES];
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * How many blocks of type BLKTYPE a magazine may hold: half a slab,
+ * but no fewer than 2 and no more than MAGSIZE.
  */
+static
+inline
+unsigned
+mag_capacity(unsigned blktype)
+{
+	unsigned cap;
+
+	cap = PR_NBLOCKS(blktype) / 2;
+	if (cap > MAGSIZE) {
+		cap = MAGSIZE;
+	}
+	if (cap < 2) {
+		cap = 2;
+	}
+	return cap;
+}
+
+////////////////////////////////////////
+
+static
+void
+pr_insert(struct pageref **head, struct pageref *pr)
+{
+	pr->prev = NULL;
+	pr->next = *head;
+	if (*head != NULL) {
+		(*head)->prev = pr;
+	}
+	*head = pr;
+}
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static
+void
+pr_remove(struct pageref **head, struct pageref *pr)
+{
+	if (pr->prev != NULL) {
+		pr->prev->next = pr->next;
+	}
+	else {
+		KASSERT(*head == pr);
+		*head = pr->next;
+	}
+	if (pr->next != NULL) {
+		pr->next->prev = pr->prev;
+	}
+	pr->next = pr->prev = NULL;
+}
 
 ////////////////////////////////////////
 
@@ -216,7 +328,8 @@ checksubpage(struct pageref *pr)
 	int blktype;
 	int nfree=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(spinlock_do_i_hold(&sizeclasses[blktype].sc_lock));
 
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		KASSERT(pr->nfree==0);
@@ -224,7 +337,6 @@ checksubpage(struct pageref *pr)
 	}
 
 	prpage = PR_PAGEADDR(pr);
-	blktype = PR_BLOCKTYPE(pr);
 
 	KASSERT(pr->freelist_offset < PAGE_SIZE);
 	KASSERT(pr->freelist_offset % sizes[blktype] == 0);
@@ -249,32 +361,35 @@ checksubpage(struct pageref *pr)
 #ifdef SLOWER
 static
 void
-checksubpages(void)
+checksubpages(struct sizeclass *sc)
 {
 	struct pageref *pr;
-	int i;
-	unsigned sc=0, ac=0;
+	unsigned blktype, ne=0;
 
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	KASSERT(spinlock_do_i_hold(&sc->sc_lock));
+	blktype = sc - sizeclasses;
 
-	for (i=0; i<NSIZES; i++) {
-		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
-			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
-			sc++;
-		}
+	for (pr = sc->sc_partial; pr != NULL; pr = pr->next) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+		KASSERT(pr->nfree > 0 && pr->nfree < PR_NBLOCKS(blktype));
+		KASSERT(pageref_lookup(PR_PAGEADDR(pr)) == pr);
 	}
-
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+	for (pr = sc->sc_full; pr != NULL; pr = pr->next) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
-		ac++;
+		KASSERT(pr->nfree == 0);
 	}
-
-	KASSERT(sc==ac);
+	for (pr = sc->sc_empty; pr != NULL; pr = pr->next) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		checksubpage(pr);
+		KASSERT(pr->nfree == PR_NBLOCKS(blktype));
+		ne++;
+	}
+	KASSERT(ne == sc->sc_nempty);
 }
 #else
-#define checksubpages() 
+#define checksubpages(sc) ((void)(sc))
 #endif
 
 ////////////////////////////////////////
@@ -290,7 +405,6 @@ dumpsubpage(struct pageref *pr)
 	uint32_t freemap[PAGE_SIZE / (SMALLEST_SUBPAGE_SIZE*32)];
 
 	checksubpage(pr);
-	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	/* clear freemap[] */
 	for (i=0; i<sizeof(freemap)/sizeof(freemap[0]); i++) {
@@ -299,9 +413,10 @@ dumpsubpage(struct pageref *pr)
 
 	prpage = PR_PAGEADDR(pr);
 	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(spinlock_do_i_hold(&sizeclasses[blktype].sc_lock));
 
 	/* compute how many bits we need in freemap and assert we fit */
-	n = PAGE_SIZE / sizes[blktype];
+	n = PR_NBLOCKS(blktype);
 	KASSERT(n <= 32*sizeof(freemap)/sizeof(freemap[0]));
 
 	if (pr->freelist_offset != INVALID_OFFSET) {
@@ -333,47 +448,42 @@ dumpsubpage(struct pageref *pr)
 void
 kheap_printstats(void)
 {
+	struct sizeclass *sc;
 	struct pageref *pr;
-
-	/* print the whole thing with interrupts off */
-	spinlock_acquire(&kmalloc_spinlock);
+	unsigned i, cpu, n;
 
 	kprintf("Subpage allocator status:\n");
 
-	for (pr = allbase; pr != NULL; pr = pr->next_all) {
-		dumpsubpage(pr);
-	}
-
-	spinlock_release(&kmalloc_spinlock);
-}
-
-////////////////////////////////////////
-
-static
-void
-remove_lists(struct pageref *pr, int blktype)
-{
-	struct pageref **guy;
-
-	KASSERT(blktype>=0 && blktype<NSIZES);
+	for (i=0; i<NSIZES; i++) {
+		sc = &sizeclasses[i];
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
+		/* print each size class with interrupts off */
+		spinlock_acquire(&sc->sc_lock);
+		for (pr = sc->sc_partial; pr != NULL; pr = pr->next) {
+			dumpsubpage(pr);
+		}
+		for (pr = sc->sc_full; pr != NULL; pr = pr->next) {
+			dumpsubpage(pr);
 		}
+		for (pr = sc->sc_empty; pr != NULL; pr = pr->next) {
+			dumpsubpage(pr);
+		}
+		spinlock_release(&sc->sc_lock);
 	}
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+	kprintf("Cached in per-cpu magazines:");
+	for (i=0; i<NSIZES; i++) {
+		n = 0;
+		for (cpu=0; cpu<MAXCPUS; cpu++) {
+			n += magazines[cpu][i].mag_nblocks;
 		}
+		kprintf(" %lu:%u", (unsigned long)sizes[i], n);
 	}
+	kprintf("\n");
 }
 
+////////////////////////////////////////
+
 static
 inline
 int blocktype(size_t sz)
@@ -392,93 +502,38 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Turn a fresh page into an empty slab of blocks of type BLKTYPE.
+ * Returns its pageref, or NULL if out of memory.
+ */
 static
-void *
-subpage_kmalloc(size_t sz)
+struct pageref *
+slab_create(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
-	struct pageref *pr;	// pageref for page we're allocating from
+	struct pageref *pr;
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
-
 	volatile int i;
 
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
-
-		/* check for corruption */
-		KASSERT(PR_BLOCKTYPE(pr) == blktype);
-		checksubpage(pr);
-
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
-	}
-
-	/*
-	 * No page of the right size available.
-	 * Make a new one.
-	 *
-	 * We release the spinlock while calling alloc_kpages. This
-	 * avoids deadlock if alloc_kpages needs to come back here.
-	 * Note that this means things can change behind our back...
-	 */
-
-	spinlock_release(&kmalloc_spinlock);
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
 		return NULL;
 	}
-	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
+	pr = pageref_get(prpage);
 	if (pr==NULL) {
 		/* Couldn't allocate accounting space for the new page. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
 		return NULL;
 	}
+	KASSERT(pr->pageaddr_and_blocktype == 0);
 
-	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
-	pr->nfree = PAGE_SIZE / sizes[blktype];
+	pr->next = pr->prev = NULL;
+	pr->nfree = PR_NBLOCKS(blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -498,54 +553,294 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	/* Setting this publishes the page as a slab to kfree. */
+	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 
-	pr->next_all = allbase;
-	allbase = pr;
+	return pr;
+}
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+/*
+ * Take a free block from slab PR of size class SC.
+ */
+static
+void *
+slab_getblock(struct sizeclass *sc, struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(spinlock_do_i_hold(&sc->sc_lock));
+
+	/* check for corruption */
+	KASSERT(PR_BLOCKTYPE(pr) == (unsigned)(sc - sizeclasses));
+	checksubpage(pr);
+	KASSERT(pr->nfree > 0);
+
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+		pr_remove(&sc->sc_partial, pr);
+		pr_insert(&sc->sc_full, pr);
+	}
+
+	return retptr;
 }
 
+/*
+ * Return block PTR to slab PR of size class SC. If that empties the
+ * slab and the size class already has enough empty slabs, the slab is
+ * dismantled and the address of its page returned for the caller to
+ * free once it has dropped the lock; otherwise returns 0.
+ */
 static
-int
-subpage_kfree(void *ptr)
+vaddr_t
+slab_putblock(struct sizeclass *sc, struct pageref *pr, void *ptr)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
-	ptraddr = (vaddr_t)ptr;
+	KASSERT(spinlock_do_i_hold(&sc->sc_lock));
+	checksubpage(pr);
 
-	spinlock_acquire(&kmalloc_spinlock);
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = (vaddr_t)ptr - prpage;
 
-	checksubpages();
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+		/* was full; usable again */
+		pr_remove(&sc->sc_full, pr);
+		pr_insert(&sc->sc_partial, pr);
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+	KASSERT(pr->nfree <= PR_NBLOCKS(blktype));
+	if (pr->nfree < PR_NBLOCKS(blktype)) {
+		return 0;
+	}
+
+	/* Whole page is free. */
+	pr_remove(&sc->sc_partial, pr);
+	if (sc->sc_nempty < MAXEMPTY) {
+		pr_insert(&sc->sc_empty, pr);
+		sc->sc_nempty++;
+		return 0;
+	}
+	pr->pageaddr_and_blocktype = 0;
+	return prpage;
+}
+
+/*
+ * Allocate up to N blocks of type BLKTYPE from the slab lists into
+ * BLOCKS. Returns how many were allocated; only makes a new slab if
+ * it couldn't get any at all, so this may be fewer than N. 0 means
+ * out of memory.
+ */
+static
+unsigned
+slab_alloc(unsigned blktype, void **blocks, unsigned n)
+{
+	struct sizeclass *sc;	// blktype's lists
+	struct pageref *pr;	// pageref for page we're allocating from
+	unsigned got;
+
+	sc = &sizeclasses[blktype];
+	got = 0;
+
+	spinlock_acquire(&sc->sc_lock);
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+	checksubpages(sc);
+
+	while (got < n) {
+		pr = sc->sc_partial;
+		if (pr == NULL && sc->sc_empty != NULL) {
+			pr = sc->sc_empty;
+			pr_remove(&sc->sc_empty, pr);
+			sc->sc_nempty--;
+			pr_insert(&sc->sc_partial, pr);
+		}
+		if (pr == NULL) {
+			if (got > 0) {
+				/* make do with what we have */
+				break;
+			}
+
+			/*
+			 * No slab of the right size available.
+			 * Make a new one.
+			 *
+			 * We release the spinlock while calling
+			 * alloc_kpages. This avoids deadlock if
+			 * alloc_kpages needs to come back here. Note
+			 * that this means things can change behind our
+			 * back, which is fine: the new slab just joins
+			 * whatever else is on the partial list by then.
+			 */
+			spinlock_release(&sc->sc_lock);
+			pr = slab_create(blktype);
+			if (pr == NULL) {
+				return 0;
+			}
+			spinlock_acquire(&sc->sc_lock);
+			pr_insert(&sc->sc_partial, pr);
 		}
+		blocks[got++] = slab_getblock(sc, pr);
 	}
 
-	if (pr==NULL) {
+	checksubpages(sc);
+
+	spinlock_release(&sc->sc_lock);
+	return got;
+}
+
+/*
+ * Return N blocks of type BLKTYPE to the slab lists.
+ */
+static
+void
+slab_free(unsigned blktype, void **blocks, unsigned n)
+{
+	struct sizeclass *sc;	// blktype's lists
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t freepages[MAGSIZE];
+	unsigned i, nfreepages;
+
+	KASSERT(n <= MAGSIZE);
+
+	sc = &sizeclasses[blktype];
+	nfreepages = 0;
+
+	spinlock_acquire(&sc->sc_lock);
+	checksubpages(sc);
+
+	for (i=0; i<n; i++) {
+		pr = pageref_lookup((vaddr_t)blocks[i]);
+		KASSERT(pr != NULL && PR_BLOCKTYPE(pr) == blktype);
+		freepages[nfreepages] = slab_putblock(sc, pr, blocks[i]);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+
+	checksubpages(sc);
+	spinlock_release(&sc->sc_lock);
+
+	/* Call free_kpages without the size class lock. */
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	unsigned blktype;	// index into sizes[] that we're using
+	struct magazine *mag;	// this cpu's cache of them
+	void *batch[MAGSIZE];	// blocks fetched from the slabs
+	unsigned cap, n;
+	void *retptr;		// our result
+	int spl;
+
+	blktype = blocktype(sz);
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot for per-cpu anything. */
+		return slab_alloc(blktype, batch, 1) ? batch[0] : NULL;
+	}
+
+	spl = splhigh();
+	mag = &magazines[curcpu->c_number][blktype];
+	if (mag->mag_nblocks > 0) {
+		retptr = mag->mag_blocks[--mag->mag_nblocks];
+		splx(spl);
+		return retptr;
+	}
+	splx(spl);
+
+	/* Magazine empty; refill half of it. */
+	cap = mag_capacity(blktype);
+	n = slab_alloc(blktype, batch, cap/2 + 1);
+	if (n == 0) {
+		return NULL;
+	}
+	retptr = batch[--n];
+
+	/* We may be on a different cpu by now. That's fine. */
+	spl = splhigh();
+	mag = &magazines[curcpu->c_number][blktype];
+	while (n > 0 && mag->mag_nblocks < cap) {
+		mag->mag_blocks[mag->mag_nblocks++] = batch[--n];
+	}
+	splx(spl);
+
+	if (n > 0) {
+		slab_free(blktype, batch, n);
+	}
+	return retptr;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	struct magazine *mag;	// this cpu's cache of them
+	void *batch[MAGSIZE];	// blocks going back to the slabs
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t offset;		// offset into page
+	unsigned cap, n;
+	int spl;
+
+	ptraddr = (vaddr_t)ptr;
+
+	/*
+	 * The page can't stop being a slab under us: that only
+	 * happens once every block on it, including this one, has
+	 * been freed.
+	 */
+	pr = pageref_lookup(ptraddr);
+	if (pr == NULL || pr->pageaddr_and_blocktype == 0) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - PR_PAGEADDR(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
 
 	/* Check for proper positioning and alignment */
 	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
@@ -558,40 +853,30 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (!CURCPU_EXISTS()) {
+		slab_free(blktype, &ptr, 1);
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+	cap = mag_capacity(blktype);
+
+	spl = splhigh();
+	mag = &magazines[curcpu->c_number][blktype];
+	if (mag->mag_nblocks < cap) {
+		mag->mag_blocks[mag->mag_nblocks++] = ptr;
+		splx(spl);
+		return 0;
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
-	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
-	spinlock_release(&kmalloc_spinlock);
-#endif
+	/* Magazine full; send half of it back along with this block. */
+	batch[0] = ptr;
+	n = 1;
+	while (n <= cap/2) {
+		batch[n++] = mag->mag_blocks[--mag->mag_nblocks];
+	}
+	splx(spl);
 
+	slab_free(blktype, batch, n);
 	return 0;
 }
 
@@ -0,0 +1,86 @@
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+#include <coremap.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NDIRS; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	KASSERT(pt != NULL);
+
+	for (i=0; i<PT_NDIRS; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+	unsigned d, i;
+
+	KASSERT(pt != NULL);
+	KASSERT(vaddr < USERSPACETOP);
+
+	d = PT_DIRINDEX(vaddr);
+	table = pt->pt_dir[d];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_NENTRIES * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_NENTRIES; i++) {
+			table[i] = 0;
+		}
+		pt->pt_dir[d] = table;
+	}
+	return &table[PT_INDEX(vaddr)];
+}
+
+bool
+pt_pin(pte_t *pte)
+{
+	pte_t old;
+
+	for (;;) {
+		old = *pte;
+		if ((old & PTE_VALID) == 0) {
+			return false;
+		}
+		if (coremap_pin(PTE_FRAME(old))) {
+			if (*pte == old) {
+				return true;
+			}
+			/* evicted and the frame reused while we waited */
+			coremap_unpin(PTE_FRAME(old));
+		}
+	}
+}
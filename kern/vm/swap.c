@@ -0,0 +1,180 @@
+/*
+ * Swap space. See swap.h.
+ *
+ * The slot allocation bitmap is protected by a spinlock. The disk
+ * itself needs no locking here: each transfer names its own offset,
+ * and the device driver serializes requests.
+ *
+ * Pages are usually written out because memory has run short, so
+ * transfers must not need any memory themselves. If the device takes
+ * requests (struct devreq), a page goes straight between its frame
+ * and the disk that way; otherwise through VOP_READ and VOP_WRITE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <uio.h>
+#include <device.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
+#include <swap.h>
+
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct vnode *swap_vnode;	/* the swap device */
+static struct device *swap_dev;		/* ...if it takes devreqs */
+static struct bitmap *swap_map;		/* one bit per slot, set if in use */
+static unsigned swap_nslots;
+
+bool
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	/* vfs_open destroys the string it's passed. */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		return false;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		kprintf("swap: %s: stat: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		vfs_close(swap_vnode);
+		return false;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	if (swap_nslots == 0) {
+		kprintf("swap: %s is too small; running without swap\n",
+			SWAP_DEVICE);
+		vfs_close(swap_vnode);
+		return false;
+	}
+
+	swap_dev = dev_getdevice(swap_vnode);
+	if (swap_dev != NULL && (swap_dev->d_submit == NULL ||
+				 PAGE_SIZE % swap_dev->d_blocksize != 0)) {
+		swap_dev = NULL;
+	}
+
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+
+	kprintf("swap: %u slots (%uk) on %s\n", swap_nslots,
+		swap_nslots * PAGE_SIZE / 1024, SWAP_DEVICE);
+	return true;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	spinlock_release(&swap_lock);
+	return result;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between the frame at PADDR and SLOT.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct devreq req;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (swap_dev != NULL) {
+		req.dr_nblocks = PAGE_SIZE / swap_dev->d_blocksize;
+		req.dr_block = slot * req.dr_nblocks;
+		req.dr_data = (void *)PADDR_TO_KVADDR(paddr);
+		req.dr_write = (rw == UIO_WRITE);
+		req.dr_callback = NULL;
+		req.dr_arg = NULL;
+		result = swap_dev->d_submit(swap_dev, &req);
+		if (result) {
+			return result;
+		}
+		swap_dev->d_wait(swap_dev, &req);
+		return req.dr_result;
+	}
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(slot, paddr, UIO_READ);
+	if (result) {
+		return result;
+	}
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return 0;
+}
+
+int
+swap_out(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(slot, paddr, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	return 0;
+}
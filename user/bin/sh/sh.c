@@ -354,6 +354,7 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
+#ifdef HOST
 	pid = fork();
 	switch (pid) {
 		case -1:
@@ -375,6 +376,14 @@ docommand(char *buf)
 		default:
 			break;
 	}
+#else
+	/* No need to copy ourselves just to run something else. */
+	pid = spawn(args[0], args);
+	if (pid < 0) {
+		warn("%s", args[0]);
+		return _MKWAIT_EXIT(255);
+	}
+#endif
 
 	/* parent */
 	if (bg) {
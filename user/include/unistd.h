@@ -119,6 +119,7 @@ __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
 int waitpid(pid_t pid, int *returncode, int flags);
+pid_t spawn(const char *prog, char *const *args);
 /* 
  * Open actually takes either two or three args: the optional third
  * arg is the file mode used for creation. Unless you're implementing
@@ -56,6 +56,8 @@
 
 #include "disk.h"
 
+static int extents;
+
 static
 uint32_t
 dumpsb(void)
@@ -68,6 +70,10 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
+	extents = (SWAPL(sp.sp_flags) & SFS_FEAT_EXTENTS) != 0;
+	if (extents) {
+		printf("Inodes use extents\n");
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -101,8 +107,9 @@ dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
 	uint32_t ib[SFS_DBPERIDB];
+	struct sfs_extent xext[SFS_XEXTENTS];
 	int nentries, i;
-	uint32_t block, nblocks=0;
+	uint32_t block, len, j, nblocks=0;
 
 	diskread(&sfi, ino);
 
@@ -112,6 +119,30 @@ dumpdir(uint32_t ino)
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
 
+	if (extents) {
+		for (i=0; i<SFS_NEXTENTS; i++) {
+			block = SWAPL(sfi.sfi_extents[i].sfe_start);
+			len = SWAPL(sfi.sfi_extents[i].sfe_len);
+			for (j=0; block != 0 && j<len; j++) {
+				dodirblock(block + j);
+				nblocks++;
+			}
+		}
+		if (SWAPL(sfi.sfi_extblock)) {
+			diskread(xext, SWAPL(sfi.sfi_extblock));
+			for (i=0; i<(int)SFS_XEXTENTS; i++) {
+				block = SWAPL(xext[i].sfe_start);
+				len = SWAPL(xext[i].sfe_len);
+				for (j=0; block != 0 && j<len; j++) {
+					dodirblock(block + j);
+					nblocks++;
+				}
+			}
+		}
+		printf("    %u blocks in directory\n", nblocks);
+		return;
+	}
+
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
 		if (block) {
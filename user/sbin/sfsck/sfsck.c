@@ -66,6 +66,9 @@
 
 static int badness=0;
 
+/* Set if the volume's inodes use extents (SFS_FEAT_EXTENTS) */
+static int extents=0;
+
 static
 void
 setbadness(int code)
@@ -83,6 +86,19 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_flags = SWAPL(sp->sp_flags);
+}
+
+static
+void
+swapextents(struct sfs_extent *exts, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		exts[i].sfe_start = SWAPL(exts[i].sfe_start);
+		exts[i].sfe_len = SWAPL(exts[i].sfe_len);
+	}
 }
 
 static
@@ -95,6 +111,13 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_type = SWAPS(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAPS(sfi->sfi_linkcount);
 
+	if (extents) {
+		swapextents(sfi->sfi_extents, SFS_NEXTENTS);
+		sfi->sfi_extblock = SWAPL(sfi->sfi_extblock);
+		sfi->sfi_extwaste = SWAPL(sfi->sfi_extwaste);
+		return;
+	}
+
 	for (i=0; i<SFS_NDIRECT; i++) {
 		sfi->sfi_direct[i] = SWAPL(sfi->sfi_direct[i]);
 	}
@@ -521,6 +544,11 @@ check_sb(void)
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
+	if (sp.sp_flags & ~SFS_FEAT_ALL) {
+		errx(EXIT_UNRECOV, "Unknown features in superblock (0x%lx)",
+		     (unsigned long) (sp.sp_flags & ~SFS_FEAT_ALL));
+	}
+	extents = (sp.sp_flags & SFS_FEAT_EXTENTS) != 0;
 
 	assert(nblocks==0);
 	assert(bitblocks==0);
@@ -565,19 +593,21 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     int isdir, int indirection)
 {
 	uint32_t entries[SFS_DBPERIDB];
-	uint32_t i, ct;
+	uint32_t i, ct, span;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/* Nothing here; skip the blocks it would have covered. */
+		for (span = 1, i = 0; i < (uint32_t)indirection; i++) {
+			span *= SFS_DBPERIDB;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -631,6 +661,151 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 }
 
+/*
+ * check_inode_blocks for a volume whose inodes use extents.
+ * returns nonzero if inode modified
+ */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_inode *sfi, int isdir)
+{
+	struct sfs_extent xext[SFS_XEXTENTS];
+	struct sfs_extent *e;
+	uint32_t size, fileblocks, base, keep, j, badcount;
+	unsigned i, nslots;
+	int ended = 0, changed = 0, xchanged = 0;
+
+	badcount = 0;
+
+	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	fileblocks = size/SFS_BLOCKSIZE;
+
+	if (sfi->sfi_extwaste != 0) {
+		warnx("Inode %lu: sfi_extwaste not zero (cleared)",
+		      (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_extwaste = 0;
+		changed = 1;
+	}
+
+	nslots = SFS_NEXTENTS;
+	if (sfi->sfi_extblock != 0 && sfi->sfi_extblock >= nblocks) {
+		warnx("Inode %lu: extent block outside the volume "
+		      "(dropped)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_extblock = 0;
+		changed = 1;
+	}
+	if (sfi->sfi_extblock != 0) {
+		diskread(xext, sfi->sfi_extblock);
+		swapextents(xext, SFS_XEXTENTS);
+		nslots += SFS_XEXTENTS;
+	}
+
+	base = 0;
+	for (i=0; i<nslots; i++) {
+		if (i < SFS_NEXTENTS) {
+			e = &sfi->sfi_extents[i];
+		}
+		else {
+			e = &xext[i - SFS_NEXTENTS];
+		}
+
+		if (ended || e->sfe_len == 0) {
+			/* Everything after the first unused one is unused */
+			ended = 1;
+			if (e->sfe_start != 0 || e->sfe_len != 0) {
+				warnx("Inode %lu: garbage in unused extent "
+				      "%u (cleared)", (unsigned long) ino, i);
+				setbadness(EXIT_RECOV);
+				e->sfe_start = e->sfe_len = 0;
+				if (i < SFS_NEXTENTS) {
+					changed = 1;
+				}
+				else {
+					xchanged = 1;
+				}
+			}
+			continue;
+		}
+
+		if (e->sfe_start != 0 &&
+		    (e->sfe_start >= nblocks ||
+		     e->sfe_len > nblocks - e->sfe_start)) {
+			warnx("Inode %lu: extent %u outside the volume "
+			      "(made a hole)", (unsigned long) ino, i);
+			setbadness(EXIT_RECOV);
+			e->sfe_start = 0;
+			if (i < SFS_NEXTENTS) {
+				changed = 1;
+			}
+			else {
+				xchanged = 1;
+			}
+		}
+
+		keep = 0;
+		if (base < fileblocks) {
+			keep = fileblocks - base;
+			if (keep > e->sfe_len) {
+				keep = e->sfe_len;
+			}
+		}
+		base += e->sfe_len;
+
+		if (e->sfe_start != 0) {
+			for (j=0; j<e->sfe_len; j++) {
+				if (j < keep) {
+					bitmap_mark(e->sfe_start + j,
+						    isdir ? B_DIRDATA : B_DATA,
+						    ino);
+				}
+				else {
+					badcount++;
+					bitmap_mark(e->sfe_start + j,
+						    B_TOFREE, 0);
+				}
+			}
+		}
+		if (keep < e->sfe_len) {
+			e->sfe_len = keep;
+			if (keep == 0) {
+				e->sfe_start = 0;
+			}
+			if (i < SFS_NEXTENTS) {
+				changed = 1;
+			}
+			else {
+				xchanged = 1;
+			}
+		}
+	}
+
+	if (badcount > 0) {
+		warnx("Inode %lu: %lu blocks after EOF (freed)", 
+		     (unsigned long) ino, (unsigned long) badcount);
+		setbadness(EXIT_RECOV);
+	}
+
+	if (sfi->sfi_extblock != 0) {
+		if (xext[0].sfe_len == 0) {
+			/* Nothing left in it */
+			bitmap_mark(sfi->sfi_extblock, B_TOFREE, 0);
+			sfi->sfi_extblock = 0;
+			changed = 1;
+		}
+		else {
+			bitmap_mark(sfi->sfi_extblock, B_IBLOCK, ino);
+			if (xchanged) {
+				swapextents(xext, SFS_XEXTENTS);
+				diskwrite(xext, sfi->sfi_extblock);
+			}
+		}
+	}
+
+	return changed;
+}
+
 /* returns nonzero if inode modified */
 static
 int
@@ -638,6 +813,10 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
 	uint32_t size, block, nblocks, badcount;
 
+	if (extents) {
+		return check_inode_extents(ino, sfi, isdir);
+	}
+
 	badcount = 0;
 
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
@@ -781,6 +960,34 @@ uint32_t
 dobmap(const struct sfs_inode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
+	unsigned i;
+
+	if (extents) {
+		struct sfs_extent xext[SFS_XEXTENTS];
+		const struct sfs_extent *e;
+
+		if (sfi->sfi_extblock != 0) {
+			diskread(xext, sfi->sfi_extblock);
+			swapextents(xext, SFS_XEXTENTS);
+		}
+		for (i=0; i<SFS_NEXTENTS+SFS_XEXTENTS; i++) {
+			if (i < SFS_NEXTENTS) {
+				e = &sfi->sfi_extents[i];
+			}
+			else if (sfi->sfi_extblock != 0) {
+				e = &xext[i - SFS_NEXTENTS];
+			}
+			else {
+				break;
+			}
+			if (fileblock < e->sfe_len) {
+				return e->sfe_start != 0 ?
+					e->sfe_start + fileblock : 0;
+			}
+			fileblock -= e->sfe_len;
+		}
+		return 0;
+	}
 
 	if (fileblock < BMAP_DMAX) {
 		return BMAP_D(sfi, fileblock);
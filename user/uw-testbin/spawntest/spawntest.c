@@ -0,0 +1,150 @@
+/*
+ * spawntest - test of spawn and waitpid
+ *
+ *  relies on spawn, waitpid, console write and _exit
+ *
+ *  spawns copies of itself with the argument "child" followed by some
+ *  test arguments. Each child checks it got them all, in order, and
+ *  exits with a code the parent checks. Also checks that spawn of a
+ *  program that isn't there fails with ENOENT and leaves no child,
+ *  that a long argument (bigger than the kernel's first guess at a
+ *  buffer) gets through intact, and that a child can only be
+ *  waited for once.
+ *
+ *  prints "spawntest: passed" at the end if everything worked.
+ *
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define SELF     "/uw-testbin/spawntest"
+#define NCHILD   8
+#define LONGLEN  3000
+
+static char longarg[LONGLEN + 1];
+
+static
+void
+makelongarg(void)
+{
+  int i;
+
+  for (i = 0; i < LONGLEN; i++) {
+    longarg[i] = 'a' + i % 26;
+  }
+  longarg[LONGLEN] = 0;
+}
+
+/* run in the child: argv is SELF child <n> <word> ... */
+static
+int
+child(int argc, char *argv[])
+{
+  int n;
+
+  if (argc < 3) {
+    errx(1, "child: only %d arguments", argc);
+  }
+  n = atoi(argv[2]);
+  if (n == NCHILD) {
+    /* the long-argument child */
+    makelongarg();
+    if (argc != 4 || strcmp(argv[3], longarg) != 0) {
+      errx(1, "child %d: long argument garbled", n);
+    }
+  }
+  else if (argc != 5 || strcmp(argv[3], "hello") != 0 ||
+           strcmp(argv[4], "world") != 0) {
+    errx(1, "child %d: wrong arguments", n);
+  }
+  if (argv[argc] != NULL) {
+    errx(1, "child %d: argv not NULL-terminated", n);
+  }
+  return 10 + n;
+}
+
+static
+pid_t
+dospawn(int n, const char *extra)
+{
+  char num[16];
+  char *args[6];
+  pid_t pid;
+
+  snprintf(num, sizeof(num), "%d", n);
+  args[0] = (char *)SELF;
+  args[1] = (char *)"child";
+  args[2] = num;
+  if (extra != NULL) {
+    args[3] = (char *)extra;
+    args[4] = NULL;
+  }
+  else {
+    args[3] = (char *)"hello";
+    args[4] = (char *)"world";
+    args[5] = NULL;
+  }
+  pid = spawn(SELF, args);
+  if (pid < 0) {
+    err(1, "spawn %d", n);
+  }
+  return pid;
+}
+
+static
+void
+dowait(int n, pid_t pid)
+{
+  int status;
+
+  if (waitpid(pid, &status, 0) != pid) {
+    err(1, "waitpid %d", n);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 10 + n) {
+    errx(1, "child %d: bad exit status 0x%x", n, status);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *badargs[] = { (char *)"nonexistent", NULL };
+  pid_t pids[NCHILD + 1];
+  int i, status;
+
+  if (argc > 1 && strcmp(argv[1], "child") == 0) {
+    return child(argc, argv);
+  }
+
+  /* a program that isn't there */
+  if (spawn("/nonexistent/program", badargs) >= 0) {
+    errx(1, "spawn of a nonexistent program succeeded");
+  }
+  if (errno != ENOENT) {
+    err(1, "spawn of a nonexistent program");
+  }
+
+  /* several at once, then wait for them all */
+  for (i = 0; i < NCHILD; i++) {
+    pids[i] = dospawn(i, NULL);
+  }
+  makelongarg();
+  pids[NCHILD] = dospawn(NCHILD, longarg);
+  for (i = 0; i <= NCHILD; i++) {
+    dowait(i, pids[i]);
+  }
+
+  /* a child already waited for is gone */
+  if (waitpid(pids[0], &status, 0) >= 0) {
+    errx(1, "second waitpid succeeded");
+  }
+
+  printf("spawntest: passed\n");
+  return 0;
+}